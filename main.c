@@ -5,10 +5,19 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <float.h>
 
 #include <unistd.h>
 #include <ctype.h>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // As found in the termios man page - (The read buffer will only accept 4095 chars)
 #define PROMPT_SIZE 4095
@@ -19,11 +28,105 @@
 
 #define STRING_OUTPUT_LEN 300
 
+static bool previewing = false; // Evaluating the line as it is typed, errors and commands with side effects are suppressed
+static bool syntax_error_raised = false;
+
 #define SYNTAX_ERROR(msg) do { \
-  fprintf(stderr, "%s:%d SYNTAX ERROR! %s\n\r", __FILE__, __LINE__, msg); \
+  syntax_error_raised = true; \
+  if (!previewing) fprintf(stderr, "%s:%d SYNTAX ERROR! %s\n\r", __FILE__, __LINE__, msg); \
+  if (trace_active) trace_error(msg); \
 } while (0)
 // exit(EXIT_FAILURE); \
 
+// Execution trace, every thread records fixed size binary events into its own ring and nothing
+// is formatted until the trace is dumped or exported. Only every trace_every-th expression is recorded
+#define TRACE_RING_SIZE 4096 // Events per thread, a power of two
+#define TRACE_RINGS 9 // The main thread and one per worker stream
+
+enum TraceEventKind {
+  TRACE_EXPRESSION, // Whole line, from tokenising to the result
+  TRACE_TOKEN,
+  TRACE_PARSE,
+  TRACE_OPERATOR,
+  TRACE_CALL, // Built-in commands and the work done on each worker thread
+  TRACE_ERROR
+};
+
+enum TraceDurationUnit { // Kept in op for spans, so long calls still fit in 32 bits
+  TRACE_NANOSECONDS,
+  TRACE_MICROSECONDS
+};
+
+typedef struct {
+  uint64_t time; // Nanoseconds since the trace started
+  uint32_t duration; // Spans in the unit held by op, length for tokens, elements for array operators
+  uint16_t offset; // Position in the source line
+  uint8_t kind;
+  uint8_t op; // Token type of the token or operator, TraceDurationUnit for spans
+  union {
+    struct { double a, b; }; // Operands, or the value of a token
+    char name[16]; // Commands and expressions, cut short
+    const char* message; // Syntax errors, always a string literal
+  };
+} TraceEvent_t;
+
+typedef struct {
+  _Atomic uint64_t head; // Only ever written by the owning thread
+  TraceEvent_t events[TRACE_RING_SIZE];
+} TraceRing_t;
+
+static TraceRing_t trace_rings[TRACE_RINGS] = {0};
+static _Thread_local TraceRing_t* trace_ring = &trace_rings[0];
+static bool trace_active = false; // Set per expression, only changes while no worker threads run
+static int trace_every = 0;
+static uint64_t trace_expressions = 0;
+static uint64_t trace_epoch = 0;
+static int trace_offset = 0; // Source position of the token being evaluated, for errors
+
+uint64_t trace_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec - trace_epoch;
+}
+
+// Returns the slot for the next event, older events are overwritten once the ring is full.
+// Readers only see it after trace_commit, so the caller fills it in first
+TraceEvent_t* trace_record(enum TraceEventKind kind, int op, int offset) {
+  uint64_t head = atomic_load_explicit(&trace_ring->head, memory_order_relaxed);
+  TraceEvent_t* event = &trace_ring->events[head & (TRACE_RING_SIZE-1)];
+  *event = (TraceEvent_t){ .time = trace_now(), .kind = kind, .op = op, .offset = offset };
+  return event;
+}
+
+void trace_commit() {
+  uint64_t head = atomic_load_explicit(&trace_ring->head, memory_order_relaxed);
+  atomic_store_explicit(&trace_ring->head, head + 1, memory_order_release);
+}
+
+// Spans are recorded when they end, start is when they began
+void trace_span(enum TraceEventKind kind, uint64_t start, const char* name, int name_len, int offset) {
+  TraceEvent_t* event = trace_record(kind, 0, offset);
+  uint64_t duration = event->time - start;
+  if (duration > UINT32_MAX) { // Over 4.29s, microseconds then saturate after 71 minutes
+    duration /= 1000;
+    event->op = TRACE_MICROSECONDS;
+  }
+  event->duration = (duration > UINT32_MAX) ? UINT32_MAX : (uint32_t)duration;
+  event->time = start;
+  if (name_len > (int)sizeof(event->name)-1) name_len = sizeof(event->name)-1;
+  memcpy(event->name, name, name_len);
+  trace_commit();
+}
+
+double trace_duration_us(const TraceEvent_t* event) {
+  return (event->op == TRACE_MICROSECONDS) ? event->duration : event->duration / 1000.0;
+}
+
+void trace_error(const char* message) {
+  trace_record(TRACE_ERROR, 0, trace_offset)->message = message;
+  trace_commit();
+}
+
 
 char* base64_chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 char base64_indices[CHAR_MAX] = {};
@@ -197,7 +300,7 @@ bool is_bracket(char c) {
   return false;
 }
 bool is_alphabetic(char c) {
-  return (!is_number(c) && !is_operator(c) && !is_bracket(c) && c != ' ' && c != '"' && c != '\'');
+  return (!is_number(c) && !is_operator(c) && !is_bracket(c) && c != ' ' && c != ',' && c != '"' && c != '\'');
 }
 
 enum OutputType {
@@ -230,7 +333,11 @@ enum TokenType {
   TOKEN_NOT = 16,
   TOKEN_COMMAND = 17,
   TOKEN_LPAREN = 18,
-  TOKEN_RPAREN = 19
+  TOKEN_RPAREN = 19,
+  TOKEN_COMMA = 21,
+  TOKEN_LBRACKET = 22,
+  TOKEN_RBRACKET = 23,
+  TOKEN_ARR = 24 // Only produced by the evaluator
 };
 
 bool is_operator_token(enum TokenType type) {
@@ -238,26 +345,43 @@ bool is_operator_token(enum TokenType type) {
   return false;
 }
 
-int get_operator_token_precedence(enum TokenType type) {
-  switch (type) {
-    case TOKEN_EQU: return 0;
-    case TOKEN_ADD: return 0;
-    case TOKEN_SUB: return 1;
-    case TOKEN_MUL: return 2;
-    case TOKEN_DIV: return 2;
-    case TOKEN_POW: return 3;
-    case TOKEN_BSR: return 4;
-    case TOKEN_BSL: return 4;
-    case TOKEN_BOR: return 4;
-    case TOKEN_BAND: return 4;
-    case TOKEN_BNOT: return 4;
-    case TOKEN_BXOR: return 4;
-    case TOKEN_NEG:  return 5;
-    case TOKEN_COMMAND: return 6;
-    case TOKEN_LPAREN:  return 7;
-    case TOKEN_RPAREN:  return 7;
-    default: return -1;
-  }
+#define TOKEN_TYPE_COUNT 25
+
+// Indexed by token type, -1 for tokens that never sit on the operator stack
+static const int8_t token_precedence[TOKEN_TYPE_COUNT] = {
+  [TOKEN_NULL] = -1,
+  [TOKEN_STR] = -1,
+  [TOKEN_EQU] = 0,
+  [TOKEN_NUM] = -1,
+  [TOKEN_MUL] = 2,
+  [TOKEN_ADD] = 0,
+  [TOKEN_SUB] = 1,
+  [TOKEN_DIV] = 2,
+  [TOKEN_POW] = 3,
+  [TOKEN_REM] = -1,
+  [TOKEN_BSL] = 4,
+  [TOKEN_BSR] = 4,
+  [TOKEN_BOR] = 4,
+  [TOKEN_BAND] = 4,
+  [TOKEN_BNOT] = 4,
+  [TOKEN_BXOR] = 4,
+  [TOKEN_NOT] = -1,
+  [TOKEN_COMMAND] = 6,
+  [TOKEN_LPAREN] = 7,
+  [TOKEN_RPAREN] = 7,
+  [TOKEN_NEG] = 5,
+  [TOKEN_COMMA] = -1,
+  [TOKEN_LBRACKET] = 7,
+  [TOKEN_RBRACKET] = 7,
+  [TOKEN_ARR] = -1
+};
+
+bool is_open_bracket_token(enum TokenType type) {
+  return type == TOKEN_LPAREN || type == TOKEN_LBRACKET;
+}
+
+bool is_close_bracket_token(enum TokenType type) {
+  return type == TOKEN_RPAREN || type == TOKEN_RBRACKET;
 }
 
 enum TokenType get_char_token_type(char c) {
@@ -268,6 +392,9 @@ enum TokenType get_char_token_type(char c) {
   switch (c) {
     case '(': return TOKEN_LPAREN;
     case ')': return TOKEN_RPAREN;
+    case '[': return TOKEN_LBRACKET;
+    case ']': return TOKEN_RBRACKET;
+    case ',': return TOKEN_COMMA;
     case '+': return TOKEN_ADD;
     case '-': return TOKEN_SUB;
     case '/': return TOKEN_DIV;
@@ -288,48 +415,72 @@ enum TokenType get_char_token_type(char c) {
 }
 
 
+// Tokens are kept as a struct of arrays, the parser and evaluator only pass around indices into these
+static uint8_t token_kinds[PROMPT_SIZE] = {0};
+static uint32_t token_offsets[PROMPT_SIZE] = {0}; // Offset into token_source, the string is not null terminated since it is just a slice of the prompt string
+static uint32_t token_lens[PROMPT_SIZE] = {0};
+static uint32_t token_ends[PROMPT_SIZE] = {0}; // Where the token ends in token_source including quotes, only used by the tokeniser
+static uint16_t token_literals[PROMPT_SIZE] = {0}; // Index into literal_values, only meaningful for TOKEN_NUM
+static int tokens_len = 0;
+
+static double literal_values[PROMPT_SIZE] = {0};
+static int literals_len = 0;
+static char* token_source = NULL;
+
+// A value on the evaluation stack, either a number, a string slice or an array
 typedef struct {
   enum TokenType type;
   double value;
-  char* str;
-  int str_len; // Has to be printed with the len, because the string is not null terminated since it is just a pointer into the prompt string
-  int precedence;
-} Token_t;
+  union { char* str; double* array; };
+  union { int str_len; int array_len; };
+} Value_t;
 
 struct BinTreeNode {
   struct BinTreeNode *l, *r;
-  Token_t token;
+  int token; // Index into the token arrays
 };
 
-void print_token(Token_t token) {
-  switch (token.type) {
-    case TOKEN_NUM: printf("TOKEN_NUM "); break;
-    case TOKEN_MUL: printf("TOKEN_MUL "); break;
-    case TOKEN_ADD: printf("TOKEN_ADD "); break;
-    case TOKEN_SUB: printf("TOKEN_SUB "); break;
-    case TOKEN_NEG: printf("TOKEN_NEG "); break;
-    case TOKEN_DIV: printf("TOKEN_DIV "); break;
-    case TOKEN_POW: printf("TOKEN_POW "); break;
-    case TOKEN_REM: printf("TOKEN_REM "); break;
-    case TOKEN_BSL: printf("TOKEN_BSL "); break;
-    case TOKEN_BSR: printf("TOKEN_BSR "); break;
-    case TOKEN_NOT: printf("TOKEN_NOT "); break;
-    case TOKEN_EQU: printf("TOKEN_EQU "); break;
-    case TOKEN_BAND: printf("TOKEN_BAND "); break;
-    case TOKEN_BOR:  printf("TOKEN_BOR "); break;
-    case TOKEN_BNOT: printf("TOKEN_BNOT "); break;
-    case TOKEN_BXOR: printf("TOKEN_BXOR "); break;
-    case TOKEN_LPAREN: printf("TOKEN_LPAREN "); break;
-    case TOKEN_RPAREN: printf("TOKEN_RPAREN "); break;
-    case TOKEN_COMMAND: printf("TOKEN_COMMAND "); break;
-    case TOKEN_STR: printf("TOKEN_STR "); break;
-    case TOKEN_NULL: printf("TOKEN_NULL "); break;
-    default: printf("TOKEN_UNKNOWN "); break;
-  }
-  for (int j = 0; j < token.str_len; j++) {
-    putchar(token.str[j]);
-  }
-  printf(" %0.2f\n", token.value);
+static inline char* token_str(int token) {
+  return token_source + token_offsets[token];
+}
+
+static inline double token_value(int token) {
+  return (token_kinds[token] == TOKEN_NUM) ? literal_values[token_literals[token]] : 0.0;
+}
+
+static inline Value_t token_to_value(int token) {
+  return (Value_t){ .type = token_kinds[token], .value = token_value(token), .str = token_str(token), .str_len = token_lens[token] };
+}
+
+const char* token_type_name(enum TokenType type) {
+  switch (type) {
+    case TOKEN_NUM: return "TOKEN_NUM";
+    case TOKEN_MUL: return "TOKEN_MUL";
+    case TOKEN_ADD: return "TOKEN_ADD";
+    case TOKEN_SUB: return "TOKEN_SUB";
+    case TOKEN_NEG: return "TOKEN_NEG";
+    case TOKEN_DIV: return "TOKEN_DIV";
+    case TOKEN_POW: return "TOKEN_POW";
+    case TOKEN_REM: return "TOKEN_REM";
+    case TOKEN_BSL: return "TOKEN_BSL";
+    case TOKEN_BSR: return "TOKEN_BSR";
+    case TOKEN_NOT: return "TOKEN_NOT";
+    case TOKEN_EQU: return "TOKEN_EQU";
+    case TOKEN_BAND: return "TOKEN_BAND";
+    case TOKEN_BOR: return "TOKEN_BOR";
+    case TOKEN_BNOT: return "TOKEN_BNOT";
+    case TOKEN_BXOR: return "TOKEN_BXOR";
+    case TOKEN_LPAREN: return "TOKEN_LPAREN";
+    case TOKEN_RPAREN: return "TOKEN_RPAREN";
+    case TOKEN_LBRACKET: return "TOKEN_LBRACKET";
+    case TOKEN_RBRACKET: return "TOKEN_RBRACKET";
+    case TOKEN_COMMA: return "TOKEN_COMMA";
+    case TOKEN_COMMAND: return "TOKEN_COMMAND";
+    case TOKEN_STR: return "TOKEN_STR";
+    case TOKEN_NULL: return "TOKEN_NULL";
+    case TOKEN_ARR: return "TOKEN_ARR";
+    default: return "TOKEN_UNKNOWN";
+  }
 }
 
 void print_help(bool advanced) {
@@ -344,49 +495,138 @@ void print_help(bool advanced) {
   }
 }
 
-bool tokencmp(const char* str, Token_t token) {
-  int str_len = strlen(str);
-  if (str_len != token.str_len) return false;
+bool tokencmp(const char* str, int token) {
+  uint32_t str_len = strlen(str);
+  if (str_len != token_lens[token]) return false;
 
-  for (int i = 0; i < token.str_len; i++) {
-    if (str[i] != token.str[i]) return false;
+  return memcmp(str, token_str(token), str_len) == 0;
+}
+
+double string_value_to_char_code(Value_t* value) {
+  if (value->type == TOKEN_STR) {
+    value->type = TOKEN_NUM;
+    value->value = (double)value->str[0];
   }
-  return true;
+  return value->value;
 }
 
-double string_token_to_char_code(Token_t* token) {
-  if (token->type == TOKEN_STR) {
-    token->type = TOKEN_NUM;
-    token->value = (double)token->str[0];
+// Functions that map a number to a number, arrays get them applied to every element
+enum MathFunction {
+  MATH_NONE,
+  MATH_SIN,
+  MATH_COS,
+  MATH_TAN,
+  MATH_ATAN,
+  MATH_DEG,
+  MATH_RAD,
+  MATH_FAH,
+  MATH_CEL,
+  MATH_ROUND,
+  MATH_FLOOR,
+  MATH_CEIL,
+  MATH_ABS,
+  MATH_SQRT
+};
+
+enum MathFunction get_math_function(int token) {
+  if (tokencmp("sin", token)) return MATH_SIN;
+  if (tokencmp("cos", token)) return MATH_COS;
+  if (tokencmp("tan", token)) return MATH_TAN;
+  if (tokencmp("atan", token)) return MATH_ATAN;
+  if (tokencmp("deg", token)) return MATH_DEG;
+  if (tokencmp("rad", token)) return MATH_RAD;
+  if (tokencmp("fah", token)) return MATH_FAH;
+  if (tokencmp("cel", token)) return MATH_CEL;
+  if (tokencmp("round", token)) return MATH_ROUND;
+  if (tokencmp("floor", token)) return MATH_FLOOR;
+  if (tokencmp("ceil", token)) return MATH_CEIL;
+  if (tokencmp("abs", token)) return MATH_ABS;
+  if (tokencmp("sqrt", token)) return MATH_SQRT;
+  return MATH_NONE;
+}
+
+double apply_math_function(enum MathFunction function, double x) {
+  switch (function) {
+    case MATH_SIN: return sin(deg_to_rad(x));
+    case MATH_COS: return cos(deg_to_rad(x));
+    case MATH_TAN: return tan(deg_to_rad(x));
+    case MATH_ATAN: return atan(deg_to_rad(x));
+    case MATH_DEG: return rad_to_deg(x);
+    case MATH_RAD: return deg_to_rad(x);
+    case MATH_FAH: return cel_to_fah(x);
+    case MATH_CEL: return fah_to_cel(x);
+    case MATH_ROUND: return round(x);
+    case MATH_FLOOR: return floor(x);
+    case MATH_CEIL: return ceil(x);
+    case MATH_ABS: return fabs(x);
+    case MATH_SQRT: return sqrt(x);
+    default: return x;
   }
-  return token->value;
 }
 
-bool debug = false;
-static Token_t tokens[PROMPT_SIZE] = {0};
-static int tokens_len = 0;
+// Every other built-in, a '-' right after any of these (or a math function) negates its argument instead of subtracting
+static const char* command_names[] = {
+  "exit", "help", "debug", "hex", "dec", "bin", "len", "chr", "char", "basedec", "baseenc",
+  "range", "sum", "mean", "min", "max", "dot", "sort", "integrate", "solve", "minimize", "plot", "diff", "grad",
+  "rand", "randn", "seed", "mc", "save", "load", "trace"
+};
+
+bool is_function_name(int token) {
+  if (get_math_function(token) != MATH_NONE) return true;
+  for (size_t i = 0; i < sizeof(command_names) / sizeof(command_names[0]); i++) {
+    if (tokencmp(command_names[i], token)) return true;
+  }
+  return false;
+}
+
+// Not run by the live preview, a line using any of them shows no preview at all. The first row has
+// side effects, the second runs loops or compiled bodies that can't be cancelled by the next key press
+static const char* preview_skipped_commands[] = {
+  "exit", "help", "debug", "plot", "rand", "randn", "seed", "mc", "save", "load", "trace",
+  "range", "sort", "integrate", "solve", "minimize", "diff", "grad"
+};
+
+bool is_preview_skipped(int token) {
+  for (size_t i = 0; i < sizeof(preview_skipped_commands) / sizeof(preview_skipped_commands[0]); i++) {
+    if (tokencmp(preview_skipped_commands[i], token)) return true;
+  }
+  return false;
+}
 
 enum TokeniserState {
   TOKENISER_NUMERIC,
   TOKENISER_HEXADECIMAL,
-  TOKENISER_BINARY
+  TOKENISER_BINARY,
+  TOKENISER_EXPONENT
 };
 
-void tokenise(char* str) {
-  if (debug) printf("TOKENISER\n");
+static int parsed_tokens_len = 0; // How many leading tokens the parser checkpoints are still valid for
 
-  memset(tokens, 0, sizeof(Token_t) * PROMPT_SIZE);
-  tokens_len = 0;
+// Lexes str, keeping the first keep_tokens tokens from the previous call on the same string
+void tokenise_from(char* str, int keep_tokens) {
+  if (str != token_source || keep_tokens > tokens_len) keep_tokens = 0;
+  tokens_len = keep_tokens;
+  literals_len = 0;
+  for (int t = keep_tokens-1; t >= 0; t--) {
+    if (token_kinds[t] == TOKEN_NUM) {
+      literals_len = token_literals[t] + 1;
+      break;
+    }
+  }
+  if (parsed_tokens_len > keep_tokens) parsed_tokens_len = keep_tokens;
+  token_source = str;
 
   int str_len = strlen(str);
-  char* token_begin = str;
+  int resume_offset = 0;
+  if (keep_tokens > 0) resume_offset = token_ends[keep_tokens-1];
+  char* token_begin = str + resume_offset;
   int token_len = 0;
 
   enum TokenType current_token_type = TOKEN_NULL;
   enum TokeniserState current_state = TOKENISER_NUMERIC;
   char string_enter_character = 0;
 
-  for (int i = 0; i < str_len; i++) {
+  for (int i = resume_offset; i < str_len; i++) {
     char c = str[i];
     char nc = (i+1 < str_len) ? str[i+1] : 0;
     bool eot = ((current_token_type != TOKEN_STR && nc == ' ') || nc == 0);
@@ -396,14 +636,17 @@ void tokenise(char* str) {
       else token_begin++;
     }
 
-    if (is_operator(c) || is_bracket(c)) {
+    if (is_operator(c) || is_bracket(c) || c == ',') {
       token_len++;
-      if (current_token_type != TOKEN_STR) {
+      bool exponent_sign = (current_state == TOKENISER_EXPONENT && (c == '+' || c == '-') && str[i-1] == 'e');
+      if (current_token_type != TOKEN_STR && !exponent_sign) {
         current_token_type = get_char_token_type(c);
         eot = true;
 
         if (current_token_type == TOKEN_SUB && !is_operator(get_char_token_type(nc))) {
-          if (tokens_len < 1 || (tokens_len > 0 && tokens[tokens_len-1].type != TOKEN_NUM)) {
+          enum TokenType lt = (tokens_len > 0) ? token_kinds[tokens_len-1] : TOKEN_NULL;
+          bool after_value = (lt == TOKEN_NUM || is_close_bracket_token(lt) || (lt == TOKEN_COMMAND && !is_function_name(tokens_len-1)));
+          if (!after_value) {
             if (get_char_token_type(nc) == TOKEN_NUM) {
               current_token_type = TOKEN_NUM;
               eot = false;
@@ -432,13 +675,9 @@ void tokenise(char* str) {
     if (c == '"' || c == '\'') {
       if (current_token_type != TOKEN_STR) string_enter_character = c;
 
-      if (c == string_enter_character)
-        if (debug) printf("%s %d ", (current_token_type == TOKEN_STR) ? "end" : "start", i);
-
       eot = false;
       if (current_token_type == TOKEN_STR && c == string_enter_character) {
         eot = true;
-        if (debug) printf("ln = %d ", token_len);
       }
 
       current_token_type = TOKEN_STR;
@@ -449,11 +688,18 @@ void tokenise(char* str) {
       eot = true;
       if ((current_state == TOKENISER_HEXADECIMAL || current_state == TOKENISER_BINARY) &&
           (get_char_token_type(nc) == TOKEN_NUM || get_char_token_type(nc) == TOKEN_COMMAND)) eot = false;
+      if (current_state == TOKENISER_EXPONENT && get_char_token_type(nc) == TOKEN_NUM) eot = false;
+      if (current_state == TOKENISER_EXPONENT && c == 'e' && (nc == '+' || nc == '-')) eot = false;
       if (current_token_type == TOKEN_NUM && token_begin[0] == '0' && get_char_token_type(nc) == TOKEN_COMMAND) {
         if (nc == 'x') current_state = TOKENISER_HEXADECIMAL;
         else if (nc == 'b') current_state = TOKENISER_BINARY;
         eot = false;
       }
+      if (current_token_type == TOKEN_NUM && current_state == TOKENISER_NUMERIC && nc == 'e' && i+2 < str_len &&
+          (is_number(str[i+2]) || ((str[i+2] == '+' || str[i+2] == '-') && i+3 < str_len && is_number(str[i+3])))) {
+        current_state = TOKENISER_EXPONENT;
+        eot = false;
+      }
     }
 
     if (eot && current_token_type != TOKEN_NULL) {
@@ -465,7 +711,12 @@ void tokenise(char* str) {
         value = atof(buf);
       }
 
-      if (current_state == TOKENISER_HEXADECIMAL) {
+      if (current_state == TOKENISER_EXPONENT) {
+        char buf[PROMPT_SIZE] = {0};
+        memcpy(buf, token_begin, token_len);
+        value = atof(buf);
+        current_token_type = TOKEN_NUM;
+      } else if (current_state == TOKENISER_HEXADECIMAL) {
         value = hex_to_f64(token_begin, token_len);
         current_token_type = TOKEN_NUM;
       } else if (current_state == TOKENISER_BINARY) {
@@ -473,211 +724,1657 @@ void tokenise(char* str) {
         current_token_type = TOKEN_NUM;
       }
 
-      tokens[tokens_len++] = (Token_t) {
-        .type = current_token_type,
-          .value = value,
-          .str = (current_token_type == TOKEN_STR) ? token_begin+1 : token_begin,
-          .str_len = (current_token_type == TOKEN_STR) ? token_len-2 : token_len,
-          .precedence = get_operator_token_precedence(current_token_type)
-      };
+      int t = tokens_len++;
+      token_kinds[t] = current_token_type;
+      token_offsets[t] = ((current_token_type == TOKEN_STR) ? token_begin+1 : token_begin) - str;
+      token_lens[t] = (current_token_type == TOKEN_STR) ? ((token_len >= 2) ? token_len-2 : 0) : token_len;
+      token_ends[t] = (token_begin - str) + token_len;
+      if (current_token_type == TOKEN_NUM) {
+        token_literals[t] = literals_len;
+        literal_values[literals_len++] = value;
+      }
       string_enter_character = 0;
       current_token_type = TOKEN_NULL;
       current_state = TOKENISER_NUMERIC;
       token_begin += token_len;
       token_len = 0;
 
-      Token_t* lt = &tokens[tokens_len-1];
-      if (tokencmp("true", *lt)) {
-        lt->type = TOKEN_NUM;
-        lt->value = 1.0;
-      } else if (tokencmp("false", *lt)) {
-        lt->type = TOKEN_NUM;
-        lt->value = 0.0;
-      } else if (tokencmp("PI", *lt) || tokencmp("pi", *lt)) {
-        lt->type = TOKEN_NUM;
-        lt->value = PI;
+      if (token_kinds[t] != TOKEN_NUM) {
+        double constant = 0.0;
+        bool is_constant = true;
+        if (tokencmp("true", t)) constant = 1.0;
+        else if (tokencmp("false", t)) constant = 0.0;
+        else if (tokencmp("PI", t) || tokencmp("pi", t)) constant = PI;
+        else is_constant = false;
+
+        if (is_constant) {
+          token_kinds[t] = TOKEN_NUM;
+          token_literals[t] = literals_len;
+          literal_values[literals_len++] = constant;
+        }
       }
 
-      if (debug) print_token(tokens[tokens_len-1]);
+      if (trace_active) {
+        TraceEvent_t* event = trace_record(TRACE_TOKEN, token_kinds[t], token_offsets[t]);
+        event->duration = token_lens[t];
+        event->a = token_value(t);
+        trace_commit();
+      }
     }
 
   }
+}
+
+void tokenise(char* str) {
+  token_source = NULL;
+  tokenise_from(str, 0);
+}
+
+// Re-lexes str after it was edited at edit_offset. The tokeniser looks up to three characters
+// ahead (for signed exponents), so only tokens that end before that are guaranteed to be unchanged
+int tokenise_edit(char* str, int edit_offset) {
+  int keep_tokens = 0;
+  if (str == token_source) {
+    while (keep_tokens < tokens_len && (int)token_ends[keep_tokens] + 2 < edit_offset) keep_tokens++;
+  }
+  tokenise_from(str, keep_tokens);
+  return keep_tokens;
+}
 
-  if (debug) printf("\n");
+bool input_pending() {
+  struct pollfd fd = { .fd = STDIN_FILENO, .events = POLLIN };
+  return poll(&fd, 1, 0) > 0;
 }
 
 static char* evaluation_string_storage = NULL;
 
-void evaluate_tokens(char* output) { // Shunting Yard Algorithm
-  if (debug) printf("PARSER\n"); 
-
-  Token_t* operator_stack[PROMPT_SIZE] = {0};
-  int operator_stack_len = 0;
-  Token_t* output_queue[PROMPT_SIZE] = {0};
-  int output_queue_len = 0;
-
-  for (int i = 0; i < tokens_len; i++) {
-    Token_t* token = &tokens[i];
-
-    if (token->type == TOKEN_NUM || token->type == TOKEN_STR) {
-      output_queue[output_queue_len++] = token;
-    } else if (is_operator_token(token->type)) {
-      if (operator_stack_len > 0) {
-        Token_t* o2 = operator_stack[operator_stack_len-1];
-        while (operator_stack_len > 0 && o2->type != TOKEN_LPAREN &&
-            (o2->precedence > token->precedence ||
-            (o2->precedence == token->precedence))
-            ) {
-          output_queue[output_queue_len++] = operator_stack[--operator_stack_len];
-          if (operator_stack_len > 0) o2 = operator_stack[operator_stack_len-1];
-        }
+static uint16_t output_queue[PROMPT_SIZE] = {0};
+static int output_queue_len = 0;
+// Parser state before each token, so parsing can resume after an unchanged prefix.
+// The operator stack is a linked list through operator_parents so older stacks stay intact
+static uint16_t parse_output_lens[PROMPT_SIZE+1] = {0};
+static int16_t parse_stack_tops[PROMPT_SIZE+1] = {-1};
+static int16_t operator_parents[PROMPT_SIZE] = {0};
+
+void parse_tokens() { // Shunting Yard Algorithm
+  uint64_t start = trace_active ? trace_now() : 0;
+  int from = parsed_tokens_len;
+  output_queue_len = parse_output_lens[from];
+  int top = parse_stack_tops[from];
+
+  for (int i = from; i < tokens_len; i++) {
+    parse_output_lens[i] = output_queue_len;
+    parse_stack_tops[i] = top;
+    enum TokenType type = token_kinds[i];
+
+    if (type == TOKEN_NUM || type == TOKEN_STR) {
+      output_queue[output_queue_len++] = i;
+    } else if (is_operator_token(type)) {
+      int precedence = token_precedence[type];
+      while (top >= 0) {
+        enum TokenType o2 = token_kinds[top];
+        if (is_open_bracket_token(o2) || token_precedence[o2] < precedence) break;
+        output_queue[output_queue_len++] = top;
+        top = operator_parents[top];
+      }
+      operator_parents[i] = top;
+      top = i;
+    } else if (is_open_bracket_token(type)) {
+      operator_parents[i] = top;
+      top = i;
+    } else if (is_close_bracket_token(type) || type == TOKEN_COMMA) {
+      while (top >= 0 && !is_open_bracket_token(token_kinds[top])) {
+        output_queue[output_queue_len++] = top;
+        top = operator_parents[top];
+      }
+      if (top >= 0 && type != TOKEN_COMMA) {
+        if (token_kinds[top] == TOKEN_LBRACKET) output_queue[output_queue_len++] = top; // Builds the array from its elements
+        top = operator_parents[top];
+      }
+    }
+  }
+  parse_output_lens[tokens_len] = output_queue_len;
+  parse_stack_tops[tokens_len] = top;
+  parsed_tokens_len = tokens_len;
+
+  // Anything left open is closed at the end of the line
+  while (top >= 0) {
+    if (token_kinds[top] != TOKEN_LPAREN) output_queue[output_queue_len++] = top;
+    top = operator_parents[top];
+  }
+
+  if (trace_active) trace_span(TRACE_PARSE, start, "parse", 5, (from < tokens_len) ? token_offsets[from] : 0);
+}
+
+#define ARRAY_POOL_BLOCKS 32
+#define ARRAY_POOL_MIN_BLOCK 4096
+#define ARRAY_POOL_MAX_ELEMENTS (1 << 25)
+#define ARRAY_PRINT_ELEMENTS 10
+#define COMMAND_MAX_ARGS 3
+
+// Array buffers are handed out from blocks that are kept between evaluations,
+// every evaluation starts again from the first block
+typedef struct {
+  double* data;
+  int cap;
+} ArrayBlock_t;
+
+static ArrayBlock_t array_pool[ARRAY_POOL_BLOCKS] = {0};
+static int array_pool_block = 0;
+static int array_pool_used = 0;
+static int array_pool_total = 0;
+
+void array_pool_reset() {
+  array_pool_block = 0;
+  array_pool_used = 0;
+}
+
+double* array_alloc(int len) {
+  if (len < 0) return NULL;
+  while (array_pool_block < ARRAY_POOL_BLOCKS) {
+    ArrayBlock_t* block = &array_pool[array_pool_block];
+    if (block->data == NULL) {
+      int cap = (array_pool_block > 0) ? array_pool[array_pool_block-1].cap * 2 : ARRAY_POOL_MIN_BLOCK;
+      if (cap < len) cap = len;
+      if (array_pool_total + cap > ARRAY_POOL_MAX_ELEMENTS) return NULL;
+      block->data = (double*)malloc(sizeof(double) * cap);
+      if (block->data == NULL) return NULL;
+      block->cap = cap;
+      array_pool_total += cap;
+    }
+    if (block->cap - array_pool_used >= len) {
+      double* buf = &block->data[array_pool_used];
+      array_pool_used += len;
+      return buf;
+    }
+    array_pool_block++;
+    array_pool_used = 0;
+  }
+  return NULL;
+}
+
+void array_pool_free() {
+  for (int i = 0; i < ARRAY_POOL_BLOCKS; i++) free(array_pool[i].data);
+}
+
+typedef double v4d __attribute__((vector_size(32), aligned(8), may_alias));
+
+// Element-wise kernels, a scalar operand is broadcast across the other one
+#define ARRAY_SIMD_KERNEL(name, OP) \
+void name(double* out, const double* a, bool a_scalar, const double* b, bool b_scalar, int n) { \
+  int i = 0; \
+  v4d sa = { a[0], a[0], a[0], a[0] }; \
+  v4d sb = { b[0], b[0], b[0], b[0] }; \
+  if (!a_scalar && !b_scalar) { \
+    for (; i + 4 <= n; i += 4) *(v4d*)&out[i] = *(v4d*)&a[i] OP *(v4d*)&b[i]; \
+  } else if (a_scalar) { \
+    for (; i + 4 <= n; i += 4) *(v4d*)&out[i] = sa OP *(v4d*)&b[i]; \
+  } else { \
+    for (; i + 4 <= n; i += 4) *(v4d*)&out[i] = *(v4d*)&a[i] OP sb; \
+  } \
+  for (; i < n; i++) out[i] = (a_scalar ? a[0] : a[i]) OP (b_scalar ? b[0] : b[i]); \
+}
+
+ARRAY_SIMD_KERNEL(array_add, +)
+ARRAY_SIMD_KERNEL(array_sub, -)
+ARRAY_SIMD_KERNEL(array_mul, *)
+ARRAY_SIMD_KERNEL(array_div, /)
+
+double array_sum(const double* a, int n) {
+  int i = 0;
+  v4d acc = {0};
+  for (; i + 4 <= n; i += 4) acc += *(v4d*)&a[i];
+  double sum = acc[0] + acc[1] + acc[2] + acc[3];
+  for (; i < n; i++) sum += a[i];
+  return sum;
+}
+
+double array_dot(const double* a, const double* b, int n) {
+  int i = 0;
+  v4d acc = {0};
+  for (; i + 4 <= n; i += 4) acc += *(v4d*)&a[i] * *(v4d*)&b[i];
+  double sum = acc[0] + acc[1] + acc[2] + acc[3];
+  for (; i < n; i++) sum += a[i] * b[i];
+  return sum;
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+double apply_number_operator(enum TokenType type, double a, double b) {
+  switch (type) {
+    case TOKEN_MUL: return a * b;
+    case TOKEN_DIV: return a / b;
+    case TOKEN_ADD: return a + b;
+    case TOKEN_SUB: return a - b;
+    case TOKEN_POW: return pow(a, b);
+    case TOKEN_REM: return (int)a % (int)b;
+    case TOKEN_BSL: return (int)a << (int)b;
+    case TOKEN_BSR: return (int)a >> (int)b;
+    case TOKEN_EQU: return (a == b);
+    case TOKEN_BOR: return (int)a | (int)b;
+    case TOKEN_BAND: return (int)a & (int)b;
+    case TOKEN_BXOR: return (int)a ^ (int)b;
+    default: SYNTAX_ERROR("Operator not implemented");
+  }
+  return 0.0;
+}
+
+double apply_unary_operator(enum TokenType type, double x) {
+  switch (type) {
+    case TOKEN_NEG: return -x;
+    case TOKEN_NOT: return !x;
+    case TOKEN_BNOT: return ~((int)x);
+    default: return x;
+  }
+}
+
+void array_operator(enum TokenType type, double* out, const double* a, bool a_scalar, const double* b, bool b_scalar, int n) {
+  if (n <= 0) return;
+  switch (type) {
+    case TOKEN_ADD: array_add(out, a, a_scalar, b, b_scalar, n); break;
+    case TOKEN_SUB: array_sub(out, a, a_scalar, b, b_scalar, n); break;
+    case TOKEN_MUL: array_mul(out, a, a_scalar, b, b_scalar, n); break;
+    case TOKEN_DIV: array_div(out, a, a_scalar, b, b_scalar, n); break;
+    default:
+      for (int i = 0; i < n; i++) out[i] = apply_number_operator(type, a_scalar ? a[0] : a[i], b_scalar ? b[0] : b[i]);
+  }
+}
+
+// Numbers are treated as arrays with one element, strings have no elements
+double* value_elements(Value_t* value, int* len) {
+  if (value->type == TOKEN_ARR) {
+    *len = value->array_len;
+    return value->array;
+  }
+  *len = (value->type == TOKEN_NUM) ? 1 : 0;
+  return (value->type == TOKEN_NUM) ? &value->value : NULL;
+}
+
+// How many comma separated arguments follow the bracket at open
+int count_arguments(int open) {
+  if (open+1 >= tokens_len || is_close_bracket_token(token_kinds[open+1])) return 0;
+  int depth = 0;
+  int args = 1;
+  for (int t = open+1; t < tokens_len; t++) {
+    enum TokenType type = token_kinds[t];
+    if (is_open_bracket_token(type)) depth++;
+    else if (is_close_bracket_token(type)) {
+      if (depth == 0) break;
+      depth--;
+    } else if (type == TOKEN_COMMA && depth == 0) args++;
+  }
+  return args;
+}
+
+int command_arity(int token) {
+  if (token+1 < tokens_len && token_kinds[token+1] == TOKEN_LPAREN) return count_arguments(token+1);
+  return 1;
+}
+
+void format_number(char* output, int size, enum OutputType output_type, double value) {
+  switch (output_type) {
+    case OUTPUT_DEC: snprintf(output, size, "%0.3f", value); break;
+    case OUTPUT_HEX: snprintf(output, size, "0x%X", (int)value); break;
+    case OUTPUT_BIN: snprintf(output, size, "0b%b", (int)value); break;
+    default: SYNTAX_ERROR("Unknown output type");
+  }
+}
+
+void format_array(char* output, int size, enum OutputType output_type, double* array, int len) {
+  int output_len = snprintf(output, size, "[");
+  for (int i = 0; i < len && i < ARRAY_PRINT_ELEMENTS && output_len < size; i++) {
+    if (i > 0) output_len += snprintf(&output[output_len], size - output_len, ", ");
+    if (output_len >= size) break;
+    format_number(&output[output_len], size - output_len, output_type, array[i]);
+    output_len += strlen(&output[output_len]);
+  }
+  if (len > ARRAY_PRINT_ELEMENTS && output_len < size) output_len += snprintf(&output[output_len], size - output_len, ", ... %d more", len - ARRAY_PRINT_ELEMENTS);
+  if (output_len < size) snprintf(&output[output_len], size - output_len, "]");
+}
+
+typedef uint64_t v4u __attribute__((vector_size(32), aligned(8), may_alias));
+
+// xoshiro256** with four streams side by side, one per vector lane and 2^128 draws apart
+typedef struct {
+  v4u s[4];
+} Rng_t;
+
+static Rng_t rng = {0};
+
+static const uint64_t RNG_JUMP[4] = { 0x180ec6d33cfd0aba, 0xd5a61266f0c9392c, 0xa9582618e03fc9aa, 0x39abdc4529b1661c }; // 2^128 draws
+static const uint64_t RNG_LONG_JUMP[4] = { 0x76e15d3efefdcbbf, 0xc5004e441c522fb3, 0x77710069854ee241, 0x39109bb02acbe635 }; // 2^192 draws
+
+#define RNG_ROTL(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+// Vectors are passed through pointers, by value they would depend on the AVX calling convention
+void rng_next(Rng_t* r, v4u* out) {
+  *out = RNG_ROTL(r->s[1] * 5, 7) * 9;
+  v4u t = r->s[1] << 17;
+  r->s[2] ^= r->s[0];
+  r->s[3] ^= r->s[1];
+  r->s[1] ^= r->s[2];
+  r->s[0] ^= r->s[3];
+  r->s[2] ^= t;
+  r->s[3] = RNG_ROTL(r->s[3], 45);
+}
+
+// Moves every lane forward by the number of draws the polynomial stands for
+void rng_jump(Rng_t* r, const uint64_t* polynomial) {
+  v4u s[4] = {0};
+  for (int i = 0; i < 4; i++) {
+    for (int b = 0; b < 64; b++) {
+      if (polynomial[i] & (1ULL << b)) {
+        for (int k = 0; k < 4; k++) s[k] ^= r->s[k];
+      }
+      v4u discard;
+      rng_next(r, &discard);
+    }
+  }
+  memcpy(r->s, s, sizeof(s));
+}
+
+void rng_seed(Rng_t* r, uint64_t seed) {
+  Rng_t lane = {0};
+  for (int k = 0; k < 4; k++) { // splitmix64, so nearby seeds still give unrelated states
+    uint64_t z = (seed += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    lane.s[k] = (v4u){0} + (z ^ (z >> 31));
+  }
+  for (int l = 0; l < 4; l++) {
+    for (int k = 0; k < 4; k++) r->s[k][l] = lane.s[k][l];
+    rng_jump(&lane, RNG_JUMP);
+  }
+}
+
+// Uniform in [0, 1), the draws that don't fit in n are dropped
+void rng_fill_uniform(Rng_t* r, double* out, int n) {
+  v4u bits;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    rng_next(r, &bits);
+    *(v4d*)&out[i] = __builtin_convertvector(bits >> 11, v4d) * 0x1.0p-53; // Top 53 bits fill the mantissa
+  }
+  if (i < n) {
+    rng_next(r, &bits);
+    v4d tail = __builtin_convertvector(bits >> 11, v4d) * 0x1.0p-53;
+    for (int j = 0; i < n; i++, j++) out[i] = tail[j];
+  }
+}
+
+// Standard normal through Box-Muller, two values from every pair of uniforms
+void rng_fill_normal(Rng_t* r, double* out, int n) {
+  rng_fill_uniform(r, out, n);
+  for (int i = 0; i + 1 < n; i += 2) {
+    double radius = sqrt(-2 * log1p(-out[i]));
+    double angle = 2 * PI * out[i+1];
+    out[i] = radius * cos(angle);
+    out[i+1] = radius * sin(angle);
+  }
+  if (n % 2 == 1) {
+    double u[2];
+    rng_fill_uniform(r, u, 2);
+    out[n-1] = sqrt(-2 * log1p(-u[0])) * cos(2 * PI * u[1]);
+  }
+}
+
+#define PROGRAM_CODE_SIZE PROMPT_SIZE
+#define PROGRAM_STACK_SIZE 256
+#define QUADRATURE_TOLERANCE 1e-10
+#define QUADRATURE_MAX_INTERVALS 2000 // Per thread, stops integrands that never converge (discontinuities, singularities)
+#define QUADRATURE_MAX_THREADS 8
+#define SOLVE_MAX_ITERATIONS 200
+#define PROGRAM_MAX_VARS 16
+#define DUAL_WIDTH 4 // Derivative directions carried through one pass
+#define MC_STREAMS 8 // Fixed so the same seed gives the same estimate on any machine
+_Static_assert(TRACE_RINGS >= 1 + QUADRATURE_MAX_THREADS && TRACE_RINGS >= 1 + MC_STREAMS, "Every worker stream needs its own trace ring");
+
+// Expressions that get evaluated many times (the body of integrate, solve, ...) are compiled
+// once into this form, so only the bound variable changes between runs
+enum InstructionType {
+  INSTR_CONST,
+  INSTR_VAR,
+  INSTR_UNARY,
+  INSTR_BINARY,
+  INSTR_CALL,
+  INSTR_RAND // Only run in batches, see run_program_columns
+};
+
+enum RandomDistribution {
+  RANDOM_UNIFORM,
+  RANDOM_NORMAL
+};
+
+typedef struct {
+  uint8_t type;
+  uint8_t op; // Operator token type for INSTR_UNARY and INSTR_BINARY, MathFunction for INSTR_CALL, RandomDistribution for INSTR_RAND
+  double value;
+} Instruction_t;
+
+typedef struct {
+  Instruction_t* code;
+  int len;
+  int max_depth;
+  int vars_len;
+  bool is_random;
+} Program_t;
+
+static Instruction_t program_code[PROGRAM_CODE_SIZE] = {0};
+static int program_code_len = 0;
+
+int find_var(int token, const int* vars, int vars_len) {
+  for (int v = 0; v < vars_len; v++) {
+    if (token_lens[token] == token_lens[vars[v]] && memcmp(token_str(token), token_str(vars[v]), token_lens[token]) == 0) return v;
+  }
+  return -1;
+}
+
+// Compiles the output queue entries [begin, end), every command token in [vars_begin, vars_end) is a bound variable
+bool compile_program(int begin, int end, int vars_begin, int vars_end, Program_t* program) {
+  if (program_code_len + (end - begin) > PROGRAM_CODE_SIZE) return false;
+  program->code = &program_code[program_code_len];
+  program->len = 0;
+  program->max_depth = 0;
+  program->vars_len = 0;
+  program->is_random = false;
+
+  int vars[PROGRAM_MAX_VARS];
+  for (int t = vars_begin; t < vars_end; t++) {
+    if (token_kinds[t] != TOKEN_COMMAND) continue;
+    if (program->vars_len >= PROGRAM_MAX_VARS) return false;
+    vars[program->vars_len++] = t;
+  }
+
+  int depth = 0;
+  for (int q = begin; q < end; q++) {
+    int token = output_queue[q];
+    enum TokenType type = token_kinds[token];
+    Instruction_t instruction = {0};
+
+    if (type == TOKEN_NUM) {
+      instruction = (Instruction_t){ .type = INSTR_CONST, .value = token_value(token) };
+      depth++;
+    } else if (type == TOKEN_COMMAND && find_var(token, vars, program->vars_len) >= 0) {
+      instruction = (Instruction_t){ .type = INSTR_VAR, .op = find_var(token, vars, program->vars_len) };
+      depth++;
+    } else if (type == TOKEN_COMMAND && (tokencmp("rand", token) || tokencmp("randn", token)) && command_arity(token) == 0) {
+      instruction = (Instruction_t){ .type = INSTR_RAND, .op = tokencmp("rand", token) ? RANDOM_UNIFORM : RANDOM_NORMAL };
+      program->is_random = true;
+      depth++;
+    } else if (type == TOKEN_COMMAND) {
+      enum MathFunction function = get_math_function(token);
+      if (function == MATH_NONE || command_arity(token) != 1 || depth < 1) return false;
+      instruction = (Instruction_t){ .type = INSTR_CALL, .op = function };
+    } else if (type == TOKEN_NEG || type == TOKEN_NOT || type == TOKEN_BNOT) {
+      if (depth < 1) return false;
+      instruction = (Instruction_t){ .type = INSTR_UNARY, .op = type };
+    } else if (is_operator_token(type)) {
+      if (depth < 2) return false;
+      instruction = (Instruction_t){ .type = INSTR_BINARY, .op = type };
+      depth--;
+    } else return false; // Strings and arrays have no meaning here
+
+    if (depth > PROGRAM_STACK_SIZE) return false;
+    if (depth > program->max_depth) program->max_depth = depth;
+    program->code[program->len++] = instruction;
+  }
+  if (depth != 1) return false;
+
+  program_code_len += program->len;
+  return true;
+}
+
+double run_program_vars(const Program_t* program, const double* vars) {
+  double stack[PROGRAM_STACK_SIZE];
+  int stack_len = 0;
+  for (int i = 0; i < program->len; i++) {
+    const Instruction_t* instruction = &program->code[i];
+    switch (instruction->type) {
+      case INSTR_CONST: stack[stack_len++] = instruction->value; break;
+      case INSTR_VAR: stack[stack_len++] = vars[instruction->op]; break;
+      case INSTR_UNARY: stack[stack_len-1] = apply_unary_operator(instruction->op, stack[stack_len-1]); break;
+      case INSTR_CALL: stack[stack_len-1] = apply_math_function(instruction->op, stack[stack_len-1]); break;
+      case INSTR_BINARY:
+        stack_len--;
+        stack[stack_len-1] = apply_number_operator(instruction->op, stack[stack_len-1], stack[stack_len]);
+        break;
+    }
+  }
+  return stack[0];
+}
+
+double run_program(const Program_t* program, double x) {
+  return run_program_vars(program, &x);
+}
+
+// Forward mode differentiation, a value with its derivative along DUAL_WIDTH directions at once
+typedef struct {
+  double value;
+  v4d tangent;
+} Dual_t;
+
+Dual_t apply_dual_operator(enum TokenType type, Dual_t a, Dual_t b) {
+  Dual_t r = { .value = apply_number_operator(type, a.value, b.value) };
+  switch (type) {
+    case TOKEN_ADD: r.tangent = a.tangent + b.tangent; break;
+    case TOKEN_SUB: r.tangent = a.tangent - b.tangent; break;
+    case TOKEN_MUL: r.tangent = a.tangent * b.value + b.tangent * a.value; break;
+    case TOKEN_DIV: r.tangent = (a.tangent * b.value - b.tangent * a.value) / (b.value * b.value); break;
+    case TOKEN_POW: {
+      double d_base = (b.value == 0.0) ? 0.0 : b.value * pow(a.value, b.value - 1);
+      double d_exponent = (a.value > 0.0) ? r.value * log(a.value) : 0.0;
+      r.tangent = a.tangent * d_base + b.tangent * d_exponent;
+      break;
+    }
+    default: r.tangent = (v4d){0}; break; // Integer and comparison operators are piecewise constant
+  }
+  return r;
+}
+
+// Derivative of a math function at x, the degree based trigonometry carries the deg_to_rad factor
+double math_function_derivative(enum MathFunction function, double x) {
+  switch (function) {
+    case MATH_SIN: return cos(deg_to_rad(x)) * PI/180;
+    case MATH_COS: return -sin(deg_to_rad(x)) * PI/180;
+    case MATH_TAN: return PI/180 / (cos(deg_to_rad(x)) * cos(deg_to_rad(x)));
+    case MATH_ATAN: return PI/180 / (1 + deg_to_rad(x) * deg_to_rad(x));
+    case MATH_DEG: return 180/PI;
+    case MATH_RAD: return PI/180;
+    case MATH_FAH: return 9.0/5;
+    case MATH_CEL: return 5.0/9;
+    case MATH_ABS: return (x > 0) - (x < 0);
+    case MATH_SQRT: return 0.5 / sqrt(x);
+    default: return 0.0; // round, floor and ceil
+  }
+}
+
+// Runs the program seeding variables [seed_begin, seed_begin + DUAL_WIDTH) as the derivative directions
+Dual_t run_program_dual(const Program_t* program, const double* vars, int seed_begin) {
+  Dual_t stack[PROGRAM_STACK_SIZE];
+  int stack_len = 0;
+  for (int i = 0; i < program->len; i++) {
+    const Instruction_t* instruction = &program->code[i];
+    Dual_t* top = &stack[(stack_len > 0) ? stack_len-1 : 0];
+    switch (instruction->type) {
+      case INSTR_CONST: stack[stack_len++] = (Dual_t){ .value = instruction->value }; break;
+      case INSTR_VAR: {
+        Dual_t var = { .value = vars[instruction->op] };
+        int direction = instruction->op - seed_begin;
+        if (direction >= 0 && direction < DUAL_WIDTH) var.tangent[direction] = 1.0;
+        stack[stack_len++] = var;
+        break;
+      }
+      case INSTR_UNARY:
+        top->value = apply_unary_operator(instruction->op, top->value);
+        top->tangent = (instruction->op == TOKEN_NEG) ? -top->tangent : (v4d){0};
+        break;
+      case INSTR_CALL:
+        top->tangent *= math_function_derivative(instruction->op, top->value);
+        top->value = apply_math_function(instruction->op, top->value);
+        break;
+      case INSTR_BINARY:
+        stack_len--;
+        stack[stack_len-1] = apply_dual_operator(instruction->op, stack[stack_len-1], stack[stack_len]);
+        break;
+    }
+  }
+  return stack[0];
+}
+
+// Exact partial derivatives for every variable, DUAL_WIDTH of them per pass
+void gradient(const Program_t* program, const double* vars, double* partials) {
+  for (int seed_begin = 0; seed_begin < program->vars_len; seed_begin += DUAL_WIDTH) {
+    Dual_t result = run_program_dual(program, vars, seed_begin);
+    for (int d = 0; d < DUAL_WIDTH && seed_begin + d < program->vars_len; d++) partials[seed_begin + d] = result.tangent[d];
+  }
+}
+
+// 7 point Gauss and 15 point Kronrod abscissae and weights on [-1, 1]
+static const double kronrod_nodes[8] = {
+  0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+  0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+  0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+  0.207784955007898467600689403773245, 0.000000000000000000000000000000000
+};
+static const double kronrod_weights[8] = {
+  0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+  0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+  0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+  0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+static const double gauss_weights[4] = {
+  0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+  0.381830050505118944950369775488975, 0.417959183673469387755102040816327
+};
+
+double gauss_kronrod(const Program_t* program, double a, double b, double* error) {
+  double center = (a + b) / 2;
+  double half = (b - a) / 2;
+  double fc = run_program(program, center);
+  double kronrod = fc * kronrod_weights[7];
+  double gauss = fc * gauss_weights[3];
+  for (int j = 0; j < 7; j++) {
+    double dx = half * kronrod_nodes[j];
+    double pair = run_program(program, center - dx) + run_program(program, center + dx);
+    kronrod += kronrod_weights[j] * pair;
+    if (j % 2 == 1) gauss += gauss_weights[j / 2] * pair;
+  }
+  *error = fabs((kronrod - gauss) * half);
+  return kronrod * half;
+}
+
+double integrate_adaptive(const Program_t* program, double a, double b, double tolerance, int* budget) {
+  double error = 0.0;
+  double result = gauss_kronrod(program, a, b, &error);
+  if (error <= tolerance || --(*budget) <= 0 || !isfinite(result)) return result;
+  if (b - a <= DBL_EPSILON * fmax(1.0, fabs(a) + fabs(b))) return result; // Can't be split any further
+  double mid = (a + b) / 2;
+  return integrate_adaptive(program, a, mid, tolerance / 2, budget) +
+    integrate_adaptive(program, mid, b, tolerance / 2, budget);
+}
+
+typedef struct {
+  const Program_t* program;
+  double a, b, tolerance, result;
+  int stream; // Picks the trace ring
+} QuadratureJob_t;
+
+void* quadrature_thread(void* data) {
+  QuadratureJob_t* job = (QuadratureJob_t*)data;
+  TraceRing_t* caller_ring = trace_ring;
+  trace_ring = &trace_rings[1 + job->stream];
+  uint64_t start = trace_active ? trace_now() : 0;
+  int budget = QUADRATURE_MAX_INTERVALS;
+  job->result = integrate_adaptive(job->program, job->a, job->b, job->tolerance, &budget);
+  if (trace_active) trace_span(TRACE_CALL, start, "quadrature", 10, 0);
+  trace_ring = caller_ring;
+  return NULL;
+}
+
+// Easy integrands are done after one rule, harder ones get their subintervals spread over threads
+double integrate(const Program_t* program, double a, double b) {
+  if (a > b) return -integrate(program, b, a); // Subdividing assumes a <= b
+  double error = 0.0;
+  double result = gauss_kronrod(program, a, b, &error);
+  double tolerance = fmax(QUADRATURE_TOLERANCE, QUADRATURE_TOLERANCE * fabs(result));
+  if (error <= tolerance || !isfinite(result)) return result;
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads_len = (cpus < 1) ? 1 : (cpus > QUADRATURE_MAX_THREADS) ? QUADRATURE_MAX_THREADS : (int)cpus;
+  if (threads_len < 2) {
+    int budget = QUADRATURE_MAX_INTERVALS;
+    return integrate_adaptive(program, a, b, tolerance, &budget);
+  }
+
+  pthread_t threads[QUADRATURE_MAX_THREADS];
+  QuadratureJob_t jobs[QUADRATURE_MAX_THREADS];
+  bool started[QUADRATURE_MAX_THREADS] = {0};
+  double width = (b - a) / threads_len;
+  for (int t = 0; t < threads_len; t++) {
+    jobs[t] = (QuadratureJob_t){ .program = program, .a = a + t * width, .b = (t == threads_len-1) ? b : a + (t+1) * width, .tolerance = tolerance / threads_len, .stream = t };
+    started[t] = (pthread_create(&threads[t], NULL, quadrature_thread, &jobs[t]) == 0);
+    if (!started[t]) quadrature_thread(&jobs[t]);
+  }
+  result = 0.0;
+  for (int t = 0; t < threads_len; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+    result += jobs[t].result;
+  }
+  return result;
+}
+
+// Brent's method, after widening the search around guess until the sign changes
+bool solve(const Program_t* program, double guess, double* root) {
+  double a = guess, fa = run_program(program, a);
+  if (fa == 0.0) {
+    *root = a;
+    return true;
+  }
+  double b = a, fb = fa;
+  double step = fmax(fabs(guess) * 0.1, 0.1);
+  for (int i = 0; i < SOLVE_MAX_ITERATIONS; i++, step *= 1.6) {
+    b = guess + step; fb = run_program(program, b);
+    if (fa * fb <= 0) break;
+    b = guess - step; fb = run_program(program, b);
+    if (fa * fb <= 0) break;
+  }
+  if (!(fa * fb <= 0)) return false;
+
+  double c = a, fc = fa, d = b - a, e = d;
+  for (int i = 0; i < SOLVE_MAX_ITERATIONS; i++) {
+    if ((fb > 0 && fc > 0) || (fb < 0 && fc < 0)) {
+      c = a; fc = fa;
+      d = e = b - a;
+    }
+    if (fabs(fc) < fabs(fb)) {
+      a = b; b = c; c = a;
+      fa = fb; fb = fc; fc = fa;
+    }
+    double tolerance = 2 * DBL_EPSILON * fabs(b) + 0.5e-15;
+    double m = (c - b) / 2;
+    if (fabs(m) <= tolerance || fb == 0.0) {
+      *root = b;
+      return true;
+    }
+    if (fabs(e) >= tolerance && fabs(fa) > fabs(fb)) {
+      double s = fb / fa, p, q;
+      if (a == c) { // Secant
+        p = 2 * m * s;
+        q = 1 - s;
+      } else { // Inverse quadratic interpolation
+        double r = fb / fc;
+        q = fa / fc;
+        p = s * (2 * m * q * (q - r) - (b - a) * (r - 1));
+        q = (q - 1) * (r - 1) * (s - 1);
+      }
+      if (p > 0) q = -q;
+      else p = -p;
+      if (2 * p < fmin(3 * m * q - fabs(tolerance * q), fabs(e * q))) {
+        e = d;
+        d = p / q;
+      } else {
+        d = e = m;
+      }
+    } else {
+      d = e = m;
+    }
+    a = b; fa = fb;
+    b += (fabs(d) > tolerance) ? d : (m > 0 ? tolerance : -tolerance);
+    fb = run_program(program, b);
+  }
+  *root = b;
+  return true;
+}
+
+// Golden-section search, returns where the minimum is
+double minimize(const Program_t* program, double a, double b) {
+  const double ratio = (sqrt(5.0) - 1) / 2;
+  double c = b - ratio * (b - a), d = a + ratio * (b - a);
+  double fc = run_program(program, c), fd = run_program(program, d);
+  for (int i = 0; i < SOLVE_MAX_ITERATIONS && fabs(b - a) > 1e-10 * (fabs(c) + fabs(d)) + 1e-12; i++) {
+    if (fc < fd) {
+      b = d; d = c; fd = fc;
+      c = b - ratio * (b - a); fc = run_program(program, c);
+    } else {
+      a = c; c = d; fc = fd;
+      d = a + ratio * (b - a); fd = run_program(program, d);
+    }
+  }
+  return (a + b) / 2;
+}
+
+#define PROGRAM_BATCH_SIZE 256
+#define PLOT_ROWS 16
+#define PLOT_MIN_COLUMNS 10
+#define PLOT_MAX_COLUMNS 200
+#define PLOT_LABEL_WIDTH 12
+#define PLOT_OVERSAMPLE 4 // Samples per braille dot column
+#define PLOT_REFINE 8 // Extra samples between two samples that are far apart on screen
+#define PLOT_FRAME_SIZE (PLOT_ROWS * (PLOT_LABEL_WIDTH + PLOT_MAX_COLUMNS * 3 + 1) + 256)
+
+// Runs the program for many values of the variable at once, each instruction goes over the whole batch.
+// columns holds max_depth * PROGRAM_BATCH_SIZE values, random numbers are drawn from r
+void run_program_columns(const Program_t* program, const double* xs, double* out, int n, double* columns, Rng_t* r) {
+  for (int begin = 0; begin < n; begin += PROGRAM_BATCH_SIZE) {
+    int len = (n - begin < PROGRAM_BATCH_SIZE) ? n - begin : PROGRAM_BATCH_SIZE;
+    int depth = 0;
+    for (int i = 0; i < program->len; i++) {
+      const Instruction_t* instruction = &program->code[i];
+      double* top = &columns[((depth > 0) ? depth-1 : 0) * PROGRAM_BATCH_SIZE];
+      switch (instruction->type) {
+        case INSTR_CONST:
+          top = &columns[depth++ * PROGRAM_BATCH_SIZE];
+          for (int j = 0; j < len; j++) top[j] = instruction->value;
+          break;
+        case INSTR_VAR:
+          top = &columns[depth++ * PROGRAM_BATCH_SIZE];
+          memcpy(top, &xs[begin], sizeof(double) * len);
+          break;
+        case INSTR_UNARY:
+          for (int j = 0; j < len; j++) top[j] = apply_unary_operator(instruction->op, top[j]);
+          break;
+        case INSTR_CALL:
+          for (int j = 0; j < len; j++) top[j] = apply_math_function(instruction->op, top[j]);
+          break;
+        case INSTR_RAND:
+          top = &columns[depth++ * PROGRAM_BATCH_SIZE];
+          if (instruction->op == RANDOM_NORMAL) rng_fill_normal(r, top, len);
+          else rng_fill_uniform(r, top, len);
+          break;
+        case INSTR_BINARY:
+          array_operator(instruction->op, top - PROGRAM_BATCH_SIZE, top - PROGRAM_BATCH_SIZE, false, top, false, len);
+          depth--;
+          break;
       }
-      operator_stack[operator_stack_len++] = token;
-    } else if (token->type == TOKEN_LPAREN) {
-      operator_stack[operator_stack_len++] = token;
-    } else if (token->type == TOKEN_RPAREN) {
-      while (operator_stack_len > 0 && operator_stack[operator_stack_len-1]->type != TOKEN_LPAREN) {
-        output_queue[output_queue_len++] = operator_stack[--operator_stack_len];
+    }
+    memcpy(&out[begin], columns, sizeof(double) * len);
+  }
+}
+
+void run_program_batch(const Program_t* program, const double* xs, double* out, int n) {
+  double* columns = array_alloc(program->max_depth * PROGRAM_BATCH_SIZE);
+  if (columns == NULL) {
+    for (int i = 0; i < n; i++) out[i] = run_program(program, xs[i]);
+    return;
+  }
+  run_program_columns(program, xs, out, n, columns, &rng);
+}
+
+typedef struct {
+  const Program_t* program;
+  Rng_t rng;
+  long samples;
+  double mean, m2; // Running mean and sum of squared differences from it
+  bool failed;
+  int stream;
+} MonteCarloJob_t;
+
+void* monte_carlo_thread(void* data) {
+  MonteCarloJob_t* job = (MonteCarloJob_t*)data;
+  double* columns = (double*)malloc(sizeof(double) * (job->program->max_depth + 1) * PROGRAM_BATCH_SIZE);
+  if (columns == NULL) {
+    job->failed = true;
+    return NULL;
+  }
+  double* batch = &columns[job->program->max_depth * PROGRAM_BATCH_SIZE];
+  TraceRing_t* caller_ring = trace_ring;
+  trace_ring = &trace_rings[1 + job->stream];
+  uint64_t start = trace_active ? trace_now() : 0;
+  long count = 0;
+  for (long begin = 0; begin < job->samples; begin += PROGRAM_BATCH_SIZE) {
+    int len = (job->samples - begin < PROGRAM_BATCH_SIZE) ? (int)(job->samples - begin) : PROGRAM_BATCH_SIZE;
+    run_program_columns(job->program, NULL, batch, len, columns, &job->rng);
+    double batch_mean = array_sum(batch, len) / len;
+    double batch_m2 = 0.0;
+    for (int i = 0; i < len; i++) batch_m2 += (batch[i] - batch_mean) * (batch[i] - batch_mean);
+
+    // Merges the batch into the running totals (Chan et al.)
+    double delta = batch_mean - job->mean;
+    long total = count + len;
+    job->mean += delta * len / total;
+    job->m2 += batch_m2 + delta * delta * ((double)count * len / total);
+    count = total;
+  }
+  if (trace_active) trace_span(TRACE_CALL, start, "mc stream", 9, 0);
+  trace_ring = caller_ring;
+  free(columns);
+  return NULL;
+}
+
+// Mean of the program over the samples and the standard error of that mean.
+// Every stream has its own generator, a long jump apart from the others
+bool monte_carlo(const Program_t* program, long samples, double* mean, double* standard_error) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  bool threaded = (cpus > 1);
+
+  pthread_t threads[MC_STREAMS];
+  MonteCarloJob_t jobs[MC_STREAMS];
+  bool started[MC_STREAMS] = {0};
+  for (int t = 0; t < MC_STREAMS; t++) {
+    rng_jump(&rng, RNG_LONG_JUMP);
+    jobs[t] = (MonteCarloJob_t){ .program = program, .rng = rng, .samples = samples / MC_STREAMS + (t < samples % MC_STREAMS), .stream = t };
+    started[t] = threaded && (pthread_create(&threads[t], NULL, monte_carlo_thread, &jobs[t]) == 0);
+    if (!started[t]) monte_carlo_thread(&jobs[t]);
+  }
+  rng_jump(&rng, RNG_LONG_JUMP); // Past every stream that was handed out
+
+  bool failed = false;
+  long count = 0;
+  double m2 = 0.0;
+  *mean = 0.0;
+  for (int t = 0; t < MC_STREAMS; t++) {
+    if (started[t]) pthread_join(threads[t], NULL);
+    failed |= jobs[t].failed;
+    if (jobs[t].samples == 0) continue;
+    double delta = jobs[t].mean - *mean;
+    long total = count + jobs[t].samples;
+    *mean += delta * jobs[t].samples / total;
+    m2 += jobs[t].m2 + delta * delta * ((double)count * jobs[t].samples / total);
+    count = total;
+  }
+  *standard_error = sqrt(m2 / (count - 1) / count);
+  return !failed;
+}
+
+static char plot_frame[PLOT_FRAME_SIZE] = {0};
+static uint8_t plot_dots[PLOT_ROWS * PLOT_MAX_COLUMNS] = {0};
+
+void plot_dot(int columns, int px, int py) {
+  if (px < 0 || py < 0 || px >= columns * 2 || py >= PLOT_ROWS * 4) return;
+  // Braille dot bits, indexed by the dot's row then column inside the cell
+  static const uint8_t bits[4][2] = { { 0x01, 0x08 }, { 0x02, 0x10 }, { 0x04, 0x20 }, { 0x40, 0x80 } };
+  plot_dots[(py / 4) * columns + px / 2] |= bits[py % 4][px % 2];
+}
+
+void plot_line(int columns, int x0, int y0, int x1, int y1) {
+  int steps = (abs(x1 - x0) > abs(y1 - y0)) ? abs(x1 - x0) : abs(y1 - y0);
+  if (steps == 0) steps = 1;
+  for (int i = 0; i <= steps; i++) {
+    plot_dot(columns, x0 + (x1 - x0) * i / steps, y0 + (y1 - y0) * i / steps);
+  }
+}
+
+// Draws expr over [a, b] as braille into the terminal, the whole frame goes out in one write
+bool plot(const Program_t* program, double a, double b) {
+  if (a == b || !isfinite(a) || !isfinite(b)) return false; // No x range to spread over the columns
+  struct winsize size = {0};
+  int columns = (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0) ? size.ws_col : 80;
+  columns -= PLOT_LABEL_WIDTH + 1;
+  if (columns < PLOT_MIN_COLUMNS) columns = PLOT_MIN_COLUMNS;
+  if (columns > PLOT_MAX_COLUMNS) columns = PLOT_MAX_COLUMNS;
+  int width = columns * 2;
+  int height = PLOT_ROWS * 4;
+
+  int samples_len = width * PLOT_OVERSAMPLE;
+  int refined_len = (samples_len - 1) * PLOT_REFINE;
+  double* xs = array_alloc(samples_len);
+  double* ys = array_alloc(samples_len);
+  double* refined_xs = array_alloc(refined_len);
+  double* refined_ys = array_alloc(refined_len);
+  if (xs == NULL || ys == NULL || refined_xs == NULL || refined_ys == NULL) return false;
+
+  for (int i = 0; i < samples_len; i++) xs[i] = a + (b - a) * i / (samples_len - 1);
+  run_program_batch(program, xs, ys, samples_len);
+
+  double y_min = INFINITY, y_max = -INFINITY;
+  for (int i = 0; i < samples_len; i++) {
+    if (!isfinite(ys[i])) continue;
+    if (ys[i] < y_min) y_min = ys[i];
+    if (ys[i] > y_max) y_max = ys[i];
+  }
+  if (y_min > y_max) return false;
+  if (y_min == y_max) {
+    y_min -= 1;
+    y_max += 1;
+  }
+  #define PLOT_X(x) ((int)round(((x) - a) / (b - a) * (width - 1)))
+  #define PLOT_Y(y) ((int)round((y_max - (y)) / (y_max - y_min) * (height - 1)))
+
+  // Intervals where the curve jumps by more than a dot get extra samples, all of them in one more batch
+  bool refine[samples_len];
+  int refined_i = 0;
+  for (int i = 0; i+1 < samples_len; i++) {
+    refine[i] = isfinite(ys[i]) && isfinite(ys[i+1]) && abs(PLOT_Y(ys[i+1]) - PLOT_Y(ys[i])) > 1;
+    if (!refine[i]) continue;
+    for (int r = 1; r <= PLOT_REFINE; r++) refined_xs[refined_i++] = xs[i] + (xs[i+1] - xs[i]) * r / (PLOT_REFINE + 1);
+  }
+  run_program_batch(program, refined_xs, refined_ys, refined_i);
+
+  memset(plot_dots, 0, sizeof(plot_dots));
+  if (y_min <= 0 && y_max >= 0) {
+    for (int px = 0; px < width; px += 2) plot_dot(columns, px, PLOT_Y(0.0));
+  }
+  refined_i = 0;
+  for (int i = 0; i < samples_len; i++) {
+    double px = xs[i], py = ys[i];
+    int points_len = (i+1 < samples_len && refine[i]) ? PLOT_REFINE : 0;
+    for (int r = 0; r <= points_len; r++) {
+      double qx = (r < points_len) ? refined_xs[refined_i + r] : (i+1 < samples_len) ? xs[i+1] : px;
+      double qy = (r < points_len) ? refined_ys[refined_i + r] : (i+1 < samples_len) ? ys[i+1] : py;
+      if (isfinite(py) && isfinite(qy) && fabs(qy - py) < (y_max - y_min) / 2) { // Don't connect across a discontinuity
+        plot_line(columns, PLOT_X(px), PLOT_Y(py), PLOT_X(qx), PLOT_Y(qy));
+      } else if (isfinite(py)) {
+        plot_dot(columns, PLOT_X(px), PLOT_Y(py));
       }
-      if (operator_stack_len > 0 && operator_stack[operator_stack_len-1]->type == TOKEN_LPAREN) operator_stack_len--;
+      px = qx;
+      py = qy;
     }
+    refined_i += points_len;
   }
-  while (operator_stack_len > 0 && operator_stack[operator_stack_len-1]->type != TOKEN_LPAREN) {
-    output_queue[output_queue_len++] = operator_stack[--operator_stack_len];
+  #undef PLOT_X
+  #undef PLOT_Y
+
+  int frame_len = 0;
+  for (int row = 0; row < PLOT_ROWS; row++) {
+    if (row == 0) frame_len += snprintf(&plot_frame[frame_len], PLOT_FRAME_SIZE - frame_len, "%*.4g |", PLOT_LABEL_WIDTH - 2, y_max);
+    else if (row == PLOT_ROWS-1) frame_len += snprintf(&plot_frame[frame_len], PLOT_FRAME_SIZE - frame_len, "%*.4g |", PLOT_LABEL_WIDTH - 2, y_min);
+    else frame_len += snprintf(&plot_frame[frame_len], PLOT_FRAME_SIZE - frame_len, "%*s |", PLOT_LABEL_WIDTH - 2, "");
+    for (int column = 0; column < columns; column++) {
+      int cell = 0x2800 + plot_dots[row * columns + column]; // Braille patterns block, encoded as UTF-8
+      plot_frame[frame_len++] = 0xE0 | (cell >> 12);
+      plot_frame[frame_len++] = 0x80 | ((cell >> 6) & 0x3F);
+      plot_frame[frame_len++] = 0x80 | (cell & 0x3F);
+    }
+    plot_frame[frame_len++] = '\n';
   }
-  if (operator_stack_len > 0 && operator_stack[operator_stack_len-1]->type == TOKEN_LPAREN) operator_stack_len--;
+  frame_len += snprintf(&plot_frame[frame_len], PLOT_FRAME_SIZE - frame_len, "%*s%-*.4g%*.4g\n", PLOT_LABEL_WIDTH, "", columns / 2, a, columns - columns / 2, b);
 
-  if (debug) {
-    for (int i = 0; i < output_queue_len; i++) {
-      print_token(*output_queue[i]);
+  fflush(stdout);
+  for (int written = 0; written < frame_len;) {
+    ssize_t n = write(STDOUT_FILENO, &plot_frame[written], frame_len - written);
+    if (n <= 0) break;
+    written += n;
+  }
+  return true;
+}
+
+// Commands whose first two arguments are an expression and the variable bound in it, neither is evaluated up front.
+// mc only takes the expression
+bool is_body_command(int token) {
+  return tokencmp("integrate", token) || tokencmp("solve", token) || tokencmp("minimize", token) || tokencmp("plot", token) ||
+    tokencmp("diff", token) || tokencmp("grad", token) || tokencmp("mc", token);
+}
+
+typedef struct {
+  int command;
+  int begin, end; // Output queue range covering the body and the variables
+  int body_end;
+  int vars_begin, vars_end; // Token range of the variables, a single name or [x, y, ...]
+  int args_len; // Arguments of the command covered by the span
+} BodySpan_t;
+
+static BodySpan_t body_spans[PROMPT_SIZE] = {0};
+static int body_spans_len = 0;
+
+void find_body_spans() {
+  body_spans_len = 0;
+  for (int t = 0; t+1 < tokens_len; t++) {
+    if (token_kinds[t] != TOKEN_COMMAND || token_kinds[t+1] != TOKEN_LPAREN || !is_body_command(t)) continue;
+
+    int args_len = tokencmp("mc", t) ? 1 : 2;
+    int commas[2] = {0};
+    int commas_len = 0;
+    int depth = 0;
+    for (int u = t+2; u < tokens_len && commas_len < args_len; u++) {
+      enum TokenType type = token_kinds[u];
+      if (is_open_bracket_token(type)) depth++;
+      else if (is_close_bracket_token(type)) {
+        if (depth == 0) break;
+        depth--;
+      } else if (type == TOKEN_COMMA && depth == 0) commas[commas_len++] = u;
     }
+    if (commas_len < args_len) continue;
+    if (args_len == 1) commas[1] = commas[0]; // No variables
+    else if (commas[1] == commas[0] + 1) continue;
+
+    body_spans[body_spans_len++] = (BodySpan_t){
+      .command = t,
+      .begin = parse_output_lens[t+2],
+      .body_end = parse_output_lens[commas[0]+1],
+      .end = parse_output_lens[commas[1]+1],
+      .vars_begin = commas[0]+1,
+      .vars_end = commas[1],
+      .args_len = args_len
+    };
   }
+}
+
+BodySpan_t* get_body_span(int command) {
+  for (int i = 0; i < body_spans_len; i++) {
+    if (body_spans[i].command == command) return &body_spans[i];
+  }
+  return NULL;
+}
+
+static char* prompt_storage = NULL; // PROMPT_HISTORY_SIZE prompts of PROMPT_SIZE chars
+static int prompt_storage_index = 0;
+
+// Session images are read with a single mmap, every reference inside is an offset from the start of the file
+#define SESSION_MAGIC "IFX"
+#define SESSION_VERSION 1
+#define SESSION_MAX_SIZE (1 << 24)
+
+enum SessionSectionKind {
+  SESSION_STRINGS = 1, // Interned text, identical history lines are stored once
+  SESSION_HISTORY = 2,
+  SESSION_RNG = 3
+};
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t size; // Of the whole image, so truncated files are rejected
+  uint32_t sections_len;
+} SessionHeader_t;
+
+typedef struct {
+  uint32_t kind;
+  uint32_t offset;
+  uint32_t len;
+} SessionSection_t;
+
+typedef struct {
+  uint32_t index; // Next history slot to be written
+  uint32_t entries_len;
+  // Followed by entries_len SessionString_t
+} SessionHistory_t;
+
+typedef struct {
+  uint32_t offset;
+  uint32_t len;
+} SessionString_t;
+
+// Returns the number of history entries written or -1
+int session_save(const char* path) {
+  int entries_len = (prompt_storage != NULL) ? PROMPT_HISTORY_SIZE : 0;
+  uint32_t history_size = sizeof(SessionHistory_t) + sizeof(SessionString_t) * entries_len;
+  uint32_t sections_offset = sizeof(SessionHeader_t);
+  uint32_t history_offset = sections_offset + sizeof(SessionSection_t) * 3;
+  uint32_t rng_offset = history_offset + history_size;
+  uint32_t strings_offset = rng_offset + sizeof(Rng_t);
+  uint32_t image_cap = strings_offset + PROMPT_SIZE * entries_len;
+
+  uint8_t* image = (uint8_t*)calloc(image_cap, 1);
+  if (image == NULL) return -1;
+
+  SessionHistory_t* history = (SessionHistory_t*)&image[history_offset];
+  SessionString_t* entries = (SessionString_t*)&history[1];
+  history->index = prompt_storage_index;
+  history->entries_len = entries_len;
+  uint32_t strings_len = 0;
+  for (int e = 0; e < entries_len; e++) {
+    const char* line = &prompt_storage[e * PROMPT_SIZE];
+    uint32_t len = strnlen(line, PROMPT_SIZE);
+    int interned = -1;
+    for (int o = 0; o < e && interned < 0; o++) {
+      if (entries[o].len == len && memcmp(&image[entries[o].offset], line, len) == 0) interned = o;
+    }
+    if (interned >= 0) {
+      entries[e] = entries[interned];
+      continue;
+    }
+    entries[e] = (SessionString_t){ .offset = strings_offset + strings_len, .len = len };
+    memcpy(&image[strings_offset + strings_len], line, len);
+    strings_len += len;
+  }
+  memcpy(&image[rng_offset], &rng, sizeof(Rng_t));
+
+  SessionSection_t* sections = (SessionSection_t*)&image[sections_offset];
+  sections[0] = (SessionSection_t){ .kind = SESSION_HISTORY, .offset = history_offset, .len = history_size };
+  sections[1] = (SessionSection_t){ .kind = SESSION_RNG, .offset = rng_offset, .len = sizeof(Rng_t) };
+  sections[2] = (SessionSection_t){ .kind = SESSION_STRINGS, .offset = strings_offset, .len = strings_len };
+  SessionHeader_t* header = (SessionHeader_t*)image;
+  memcpy(header->magic, SESSION_MAGIC, sizeof(header->magic));
+  header->version = SESSION_VERSION;
+  header->size = strings_offset + strings_len;
+  header->sections_len = 3;
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  uint32_t written = 0;
+  while (fd >= 0 && written < header->size) {
+    ssize_t n = write(fd, &image[written], header->size - written);
+    if (n <= 0) break;
+    written += n;
+  }
+  bool saved = (fd >= 0 && written == header->size);
+  if (fd >= 0 && close(fd) != 0) saved = false;
+  free(image);
+  return saved ? entries_len : -1;
+}
+
+bool session_range_valid(const SessionHeader_t* header, uint32_t offset, uint32_t len) {
+  return offset <= header->size && len <= header->size - offset;
+}
+
+// Returns the number of history entries restored or -1, nothing changes unless the whole image is valid
+int session_load(const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(SessionHeader_t) || file_stat.st_size > SESSION_MAX_SIZE) {
+    close(fd);
+    return -1;
+  }
+  size_t image_size = file_stat.st_size;
+  uint8_t* image = (uint8_t*)mmap(NULL, image_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) return -1;
+
+  const SessionHeader_t* header = (const SessionHeader_t*)image;
+  const SessionHistory_t* history = NULL;
+  uint32_t rng_offset = 0; // Copied out with memcpy, it isn't aligned for Rng_t
+  bool valid = memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) == 0 && header->version == SESSION_VERSION &&
+    header->size == image_size && session_range_valid(header, sizeof(SessionHeader_t), sizeof(SessionSection_t) * (uint64_t)header->sections_len);
+  for (uint32_t i = 0; valid && i < header->sections_len; i++) {
+    SessionSection_t section;
+    memcpy(&section, &image[sizeof(SessionHeader_t) + sizeof(SessionSection_t) * i], sizeof(section));
+    if (!session_range_valid(header, section.offset, section.len) || section.offset % sizeof(uint32_t) != 0) valid = false;
+    else if (section.kind == SESSION_HISTORY && section.len >= sizeof(SessionHistory_t)) {
+      history = (const SessionHistory_t*)&image[section.offset];
+      valid = (section.len - sizeof(SessionHistory_t)) / sizeof(SessionString_t) >= history->entries_len;
+    } else if (section.kind == SESSION_RNG && section.len == sizeof(Rng_t)) {
+      rng_offset = section.offset;
+    } // Unknown sections are skipped
+  }
+
+  int entries_len = (history != NULL && prompt_storage != NULL) ? history->entries_len : 0;
+  if (entries_len > PROMPT_HISTORY_SIZE) entries_len = PROMPT_HISTORY_SIZE;
+  const SessionString_t* entries = (history != NULL) ? (const SessionString_t*)&history[1] : NULL;
+  for (int e = 0; valid && e < entries_len; e++) {
+    valid = session_range_valid(header, entries[e].offset, entries[e].len) && entries[e].len < PROMPT_SIZE;
+  }
+
+  if (valid) {
+    if (entries_len > 0) {
+      memset(prompt_storage, 0, PROMPT_SIZE * PROMPT_HISTORY_SIZE);
+      for (int e = 0; e < entries_len; e++) memcpy(&prompt_storage[e * PROMPT_SIZE], &image[entries[e].offset], entries[e].len);
+      prompt_storage_index = history->index % PROMPT_HISTORY_SIZE;
+    }
+    if (rng_offset > 0) memcpy(&rng, &image[rng_offset], sizeof(Rng_t));
+  }
+  munmap(image, image_size);
+  return valid ? entries_len : -1;
+}
+
+static const char* trace_kind_names[] = { "expression", "token", "parse", "operator", "call", "error" };
+
+// Oldest event still in the ring
+uint64_t trace_first(uint64_t head) {
+  return (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+}
+
+// Readable listing of every recorded event, returns how many there were
+int trace_dump() {
+  int events_len = 0;
+  for (int r = 0; r < TRACE_RINGS; r++) {
+    uint64_t head = atomic_load_explicit(&trace_rings[r].head, memory_order_acquire);
+    if (head == 0) continue;
+    printf((r == 0) ? "main thread\n" : "worker %d\n", r-1);
+    for (uint64_t e = trace_first(head); e < head; e++, events_len++) {
+      const TraceEvent_t* event = &trace_rings[r].events[e & (TRACE_RING_SIZE-1)];
+      printf("%12.3fus %-10s @%-4d ", event->time / 1000.0, trace_kind_names[event->kind], event->offset);
+      switch (event->kind) {
+        case TRACE_TOKEN:
+          if (event->op == TOKEN_NUM) printf("%s len %u value %0.3f\n", token_type_name(event->op), event->duration, event->a);
+          else printf("%s len %u\n", token_type_name(event->op), event->duration);
+          break;
+        case TRACE_OPERATOR:
+          if (event->duration > 0) printf("%s over %u elements\n", token_type_name(event->op), event->duration);
+          else printf("%s %0.3f %0.3f\n", token_type_name(event->op), event->a, event->b);
+          break;
+        case TRACE_ERROR: printf("%s\n", event->message); break;
+        default: printf("%s took %0.3fus\n", event->name, trace_duration_us(event)); break;
+      }
+    }
+  }
+  return events_len;
+}
+
+void json_string(FILE* file, const char* str) {
+  fputc('"', file);
+  for (; *str != 0; str++) {
+    if (*str == '"' || *str == '\\') fprintf(file, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20) fprintf(file, "\\u%04x", *str);
+    else fputc(*str, file);
+  }
+  fputc('"', file);
+}
+
+// JSON has no NaN or infinity
+void json_number(FILE* file, double value) {
+  if (isfinite(value)) fprintf(file, "%.17g", value);
+  else fprintf(file, "\"%g\"", value);
+}
+
+// Writes the trace in the Chrome trace event format (chrome://tracing, Perfetto), returns the number of events or -1
+int trace_export(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) return -1;
+  int events_len = 0;
+  fprintf(file, "{\"traceEvents\":[");
+  for (int r = 0; r < TRACE_RINGS; r++) {
+    uint64_t head = atomic_load_explicit(&trace_rings[r].head, memory_order_acquire);
+    for (uint64_t e = trace_first(head); e < head; e++, events_len++) {
+      const TraceEvent_t* event = &trace_rings[r].events[e & (TRACE_RING_SIZE-1)];
+      fprintf(file, "%s\n{\"name\":", (events_len > 0) ? "," : "");
+      switch (event->kind) {
+        case TRACE_TOKEN:
+        case TRACE_OPERATOR: json_string(file, token_type_name(event->op)); break;
+        case TRACE_ERROR: json_string(file, event->message); break;
+        default: json_string(file, event->name); break;
+      }
+      fprintf(file, ",\"cat\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", trace_kind_names[event->kind], r, event->time / 1000.0);
+      if (event->kind == TRACE_TOKEN || event->kind == TRACE_OPERATOR || event->kind == TRACE_ERROR) fprintf(file, ",\"ph\":\"i\",\"s\":\"t\"");
+      else fprintf(file, ",\"ph\":\"X\",\"dur\":%.3f", trace_duration_us(event));
+      fprintf(file, ",\"args\":{\"offset\":%d", event->offset);
+      if (event->kind == TRACE_TOKEN) {
+        fprintf(file, ",\"len\":%u,\"value\":", event->duration);
+        json_number(file, event->a);
+      } else if (event->kind == TRACE_OPERATOR && event->duration > 0) {
+        fprintf(file, ",\"elements\":%u", event->duration);
+      } else if (event->kind == TRACE_OPERATOR) {
+        fprintf(file, ",\"a\":");
+        json_number(file, event->a);
+        fprintf(file, ",\"b\":");
+        json_number(file, event->b);
+      }
+      fprintf(file, "}}");
+    }
+  }
+  fprintf(file, "\n]}\n");
+  bool written = !ferror(file);
+  if (fclose(file) != 0) written = false;
+  return written ? events_len : -1;
+}
+
+// Returns false if the evaluation was abandoned, only happens while previewing
+bool evaluate_tokens(char* output) {
+  parse_tokens();
+  array_pool_reset();
+  program_code_len = 0;
+  find_body_spans();
+  int body_span_i = 0;
 
   enum OutputType output_type = OUTPUT_DEC;
-  Token_t evaluation_stack[PROMPT_SIZE] = {0};
+  Value_t evaluation_stack[PROMPT_SIZE];
+  evaluation_stack[0] = (Value_t){0};
   int evaluation_stack_len = 0;
 
   int string_storage_len = 0;
 
   for (int i = 0; i < output_queue_len; i++) {
-    Token_t* token = output_queue[i];
-
-    if (token->type == TOKEN_NUM || token->type == TOKEN_STR) {
-      evaluation_stack[evaluation_stack_len++] = *token;
-    } else if (is_operator_token(token->type)) {
-      if (token->type == TOKEN_COMMAND) {
-        bool has_arg = (evaluation_stack_len > 0); 
-        Token_t arg = has_arg ? evaluation_stack[--evaluation_stack_len] : (Token_t){0};
+    if (previewing && (i & 63) == 63 && input_pending()) return false;
+    while (body_span_i < body_spans_len && body_spans[body_span_i].begin < i) body_span_i++;
+    if (body_span_i < body_spans_len && body_spans[body_span_i].begin == i && body_spans[body_span_i].end > i) {
+      i = body_spans[body_span_i].end - 1; // Compiled when the command itself runs
+      continue;
+    }
+    int token = output_queue[i];
+    enum TokenType type = token_kinds[token];
+    trace_offset = token_offsets[token];
+
+    if (type == TOKEN_NUM || type == TOKEN_STR) {
+      evaluation_stack[evaluation_stack_len++] = token_to_value(token);
+    } else if (type == TOKEN_LBRACKET) {
+      int elements_len = count_arguments(token);
+      if (elements_len > evaluation_stack_len) elements_len = evaluation_stack_len;
+      evaluation_stack_len -= elements_len;
+
+      int array_len = 0;
+      for (int e = 0; e < elements_len; e++) {
+        Value_t* element = &evaluation_stack[evaluation_stack_len + e];
+        if (element->type == TOKEN_STR) SYNTAX_ERROR("Arrays can only hold numbers");
+        array_len += (element->type == TOKEN_ARR) ? element->array_len : 1;
+      }
+      double* array = array_alloc(array_len);
+      if (array == NULL) {
+        SYNTAX_ERROR("Array too large");
+        break;
+      }
+      int array_i = 0;
+      for (int e = 0; e < elements_len; e++) {
+        int len = 0;
+        double* elements = value_elements(&evaluation_stack[evaluation_stack_len + e], &len);
+        if (len > 0) memcpy(&array[array_i], elements, sizeof(double) * len);
+        array_i += len;
+      }
+      evaluation_stack[evaluation_stack_len++] = (Value_t){ .type = TOKEN_ARR, .array = array, .array_len = array_i };
+    } else if (is_operator_token(type)) {
+      if (type == TOKEN_COMMAND) {
+        uint64_t call_start = trace_active ? trace_now() : 0;
+        int arity = command_arity(token);
+        BodySpan_t* body_span = is_body_command(token) ? get_body_span(token) : NULL;
+        if (body_span != NULL) arity -= body_span->args_len;
+        if (arity > evaluation_stack_len) arity = evaluation_stack_len;
+        if (arity > COMMAND_MAX_ARGS) {
+          SYNTAX_ERROR("Too many arguments");
+          evaluation_stack_len -= arity - COMMAND_MAX_ARGS;
+          arity = COMMAND_MAX_ARGS;
+        }
+        Value_t args[COMMAND_MAX_ARGS] = {0};
+        for (int a = arity-1; a >= 0; a--) args[a] = evaluation_stack[--evaluation_stack_len];
+        bool has_arg = (arity > 0); 
+        Value_t arg = args[0];
+        int arg_len = 0;
+        double* arg_elements = value_elements(&arg, &arg_len);
+
         double return_val = 0.0;
         bool is_string_output = false;
         char string_output[STRING_OUTPUT_LEN] = {0};
-        if (tokencmp("exit", *token)) {
+        bool is_array_output = false;
+        Value_t array_output = {0};
+        if (previewing && is_preview_skipped(token)) {
+          return false;
+        } else if (tokencmp("exit", token)) {
           exit((has_arg) ? (int)arg.value : 0);
           return_val = -1;
-        } else if (tokencmp("help", *token)) { print_help((arg.value == 1));
-        } else if (tokencmp("debug", *token)) {
-          if (arg.value >= 1) debug = true;
-          else debug = false;
-          if (debug) printf("%0.2f %b\n", arg.value, debug);
-          return_val = (double)debug;
-
-        } else if (tokencmp("sin", *token)) { return_val = sin(deg_to_rad(arg.value));
-        } else if (tokencmp("cos", *token)) { return_val = cos(deg_to_rad(arg.value));
-        } else if (tokencmp("tan", *token)) { return_val = tan(deg_to_rad(arg.value));
-        } else if (tokencmp("atan", *token)) { return_val = atan(deg_to_rad(arg.value));
-        } else if (tokencmp("deg", *token)) { return_val = rad_to_deg(arg.value);
-        } else if (tokencmp("rad", *token)) { return_val = deg_to_rad(arg.value);
-        } else if (tokencmp("fah", *token)) { return_val = cel_to_fah(arg.value);
-        } else if (tokencmp("cel", *token)) { return_val = fah_to_cel(arg.value);
-        } else if (tokencmp("hex", *token)) { output_type = OUTPUT_HEX; return_val = string_token_to_char_code(&arg);
-        } else if (tokencmp("dec", *token)) { output_type = OUTPUT_DEC; return_val = string_token_to_char_code(&arg);
-        } else if (tokencmp("bin", *token)) { output_type = OUTPUT_BIN; return_val = string_token_to_char_code(&arg); 
-        } else if (tokencmp("round", *token)) { return_val = round(arg.value);
-        } else if (tokencmp("floor", *token)) { return_val = floor(arg.value);
-        } else if (tokencmp("ceil", *token)) { return_val = ceil(arg.value);
-        } else if (tokencmp("abs", *token)) { return_val = fabs(arg.value);
-        } else if (tokencmp("sqrt", *token)) { return_val = sqrtf(arg.value);
-        } else if (tokencmp("len", *token)) { return_val = arg.str_len;
-        } else if (tokencmp("chr", *token) || tokencmp("char", *token)) { is_string_output = true; return_val = arg.value;
-        } else if (tokencmp("basedec", *token)) {
+        } else if (tokencmp("help", token)) { print_help((arg.value == 1));
+        } else if (tokencmp("debug", token)) { // Traces every n-th expression from the next one on, 0 turns it off
+          trace_every = (arg.value >= 1 && arg.value <= INT_MAX) ? (int)arg.value : 0;
+          trace_expressions = 0;
+          if (trace_epoch == 0) trace_epoch = trace_now();
+          return_val = trace_every;
+        } else if (tokencmp("trace", token)) {
+          if (!has_arg) return_val = trace_dump();
+          else {
+            char path[PATH_MAX] = {0};
+            if (arg.type != TOKEN_STR || arg.str_len <= 0 || arg.str_len >= PATH_MAX) SYNTAX_ERROR("Expected a file name string");
+            else {
+              memcpy(path, arg.str, arg.str_len);
+              return_val = trace_export(path);
+              if (return_val < 0) SYNTAX_ERROR("Could not write the trace");
+            }
+          }
+
+        } else if (get_math_function(token) != MATH_NONE) {
+          enum MathFunction function = get_math_function(token);
+          if (arg.type == TOKEN_ARR) {
+            for (int e = 0; e < arg.array_len; e++) arg.array[e] = apply_math_function(function, arg.array[e]);
+            is_array_output = true;
+            array_output = arg;
+          } else return_val = apply_math_function(function, arg.value);
+        } else if (tokencmp("hex", token) || tokencmp("dec", token) || tokencmp("bin", token)) {
+          if (tokencmp("hex", token)) output_type = OUTPUT_HEX;
+          else if (tokencmp("bin", token)) output_type = OUTPUT_BIN;
+          else output_type = OUTPUT_DEC;
+          if (arg.type == TOKEN_ARR) {
+            is_array_output = true;
+            array_output = arg;
+          } else return_val = string_value_to_char_code(&arg);
+        } else if (tokencmp("len", token)) { return_val = arg.str_len;
+        } else if (tokencmp("chr", token) || tokencmp("char", token)) { is_string_output = true; return_val = arg.value;
+        } else if (tokencmp("basedec", token)) {
           is_string_output = true;
           return_val = 0;
           base64_decode(arg.str, arg.str_len, string_output); // TODO: make this sized string output safe
-        } else if (tokencmp("baseenc", *token)) {
+        } else if (tokencmp("baseenc", token)) {
           is_string_output = true;
           return_val = 0;
           base64_encode(arg.str, arg.str_len, string_output); // TODO: make this sized string output safe
+        } else if (tokencmp("range", token)) {
+          double begin = (arity >= 2) ? args[0].value : 0.0;
+          double end = (arity >= 2) ? args[1].value : args[0].value;
+          double step = (arity >= 3) ? args[2].value : 1.0;
+          double count = (step != 0.0) ? ceil((end - begin) / step) : -1;
+          if (!(count >= 0 && count <= ARRAY_POOL_MAX_ELEMENTS)) { // Also catches NaN bounds and steps
+            SYNTAX_ERROR("Invalid range");
+          } else {
+            double* array = array_alloc((int)count);
+            if (array == NULL) SYNTAX_ERROR("Array too large");
+            else {
+              for (int e = 0; e < (int)count; e++) array[e] = begin + e * step;
+              is_array_output = true;
+              array_output = (Value_t){ .type = TOKEN_ARR, .array = array, .array_len = (int)count };
+            }
+          }
+        } else if (is_body_command(token)) {
+          Program_t body = {0};
+          bool is_grad = tokencmp("grad", token);
+          bool is_mc = tokencmp("mc", token);
+          bool takes_one = is_grad || is_mc || tokencmp("solve", token) || tokencmp("diff", token);
+          if (body_span == NULL || arity != (takes_one ? 1 : 2)) {
+            SYNTAX_ERROR(is_mc ? "Expected (expression, samples) arguments" : "Expected (expression, variable, ...) arguments");
+          } else if (!compile_program(body_span->begin, body_span->body_end, body_span->vars_begin, body_span->vars_end, &body)) {
+            SYNTAX_ERROR("Expression can only use numbers, operators and math functions");
+          } else if (body.is_random && !is_mc) {
+            SYNTAX_ERROR("rand() and randn() only work inside mc");
+          } else if (!is_mc && (body.vars_len < 1 || (!is_grad && body.vars_len != 1))) {
+            SYNTAX_ERROR("Expected a single variable");
+          } else if (is_mc) {
+            double* estimate = array_alloc(2);
+            if (!(arg.value >= 2 && arg.value <= LONG_MAX)) SYNTAX_ERROR("mc needs at least 2 samples");
+            else if (estimate == NULL || !monte_carlo(&body, (long)arg.value, &estimate[0], &estimate[1])) SYNTAX_ERROR("Failed allocating memory");
+            else {
+              is_array_output = true;
+              array_output = (Value_t){ .type = TOKEN_ARR, .array = estimate, .array_len = 2 };
+            }
+          } else if (tokencmp("diff", token)) {
+            if (arg.type == TOKEN_ARR) { // Derivative at every point
+              for (int e = 0; e < arg.array_len; e++) arg.array[e] = run_program_dual(&body, &arg.array[e], 0).tangent[0];
+              is_array_output = true;
+              array_output = arg;
+            } else return_val = run_program_dual(&body, &arg.value, 0).tangent[0];
+          } else if (is_grad) {
+            double* partials = array_alloc(body.vars_len);
+            if (arg_len != body.vars_len) SYNTAX_ERROR("Expected a value for every variable");
+            else if (partials == NULL) SYNTAX_ERROR("Array too large");
+            else {
+              gradient(&body, arg_elements, partials);
+              is_array_output = true;
+              array_output = (Value_t){ .type = TOKEN_ARR, .array = partials, .array_len = body.vars_len };
+            }
+          } else if (tokencmp("integrate", token)) {
+            return_val = integrate(&body, args[0].value, args[1].value);
+          } else if (tokencmp("minimize", token)) {
+            return_val = minimize(&body, args[0].value, args[1].value);
+          } else if (tokencmp("plot", token)) {
+            if (!plot(&body, args[0].value, args[1].value)) SYNTAX_ERROR("Nothing to plot");
+            is_string_output = true; // Already drawn, the result is an empty string
+            return_val = 0;
+          } else if (!solve(&body, args[0].value, &return_val)) {
+            SYNTAX_ERROR("No root found");
+            return_val = NAN;
+          }
+        } else if (tokencmp("rand", token) || tokencmp("randn", token)) {
+          bool is_normal = tokencmp("randn", token);
+          if (!has_arg) { // A whole vector of draws is made, the rest of it is dropped
+            if (is_normal) rng_fill_normal(&rng, &return_val, 1);
+            else rng_fill_uniform(&rng, &return_val, 1);
+          } else {
+            int len = (arg.value >= 0 && arg.value <= ARRAY_POOL_MAX_ELEMENTS) ? (int)arg.value : -1;
+            double* draws = (len >= 0) ? array_alloc(len) : NULL;
+            if (draws == NULL) SYNTAX_ERROR("Array too large");
+            else {
+              if (is_normal) rng_fill_normal(&rng, draws, len);
+              else rng_fill_uniform(&rng, draws, len);
+              is_array_output = true;
+              array_output = (Value_t){ .type = TOKEN_ARR, .array = draws, .array_len = len };
+            }
+          }
+        } else if (tokencmp("save", token) || tokencmp("load", token)) {
+          char path[PATH_MAX] = {0};
+          if (arg.type != TOKEN_STR || arg.str_len <= 0 || arg.str_len >= PATH_MAX) SYNTAX_ERROR("Expected a file name string");
+          else {
+            memcpy(path, arg.str, arg.str_len);
+            return_val = tokencmp("save", token) ? session_save(path) : session_load(path);
+            if (return_val < 0) SYNTAX_ERROR(tokencmp("save", token) ? "Could not save the session" : "Not a valid session file");
+          }
+        } else if (tokencmp("seed", token)) {
+          if (!(fabs(arg.value) < 0x1p63)) SYNTAX_ERROR("Seed must be a number between -2^63 and 2^63"); // Also catches NaN
+          else {
+            rng_seed(&rng, (uint64_t)(int64_t)arg.value);
+            return_val = arg.value;
+          }
+        } else if (tokencmp("sum", token) || tokencmp("mean", token)) {
+          int elements_len = 0;
+          for (int a = 0; a < arity; a++) {
+            int len = 0;
+            double* elements = value_elements(&args[a], &len);
+            return_val += array_sum(elements, len);
+            elements_len += len;
+          }
+          if (tokencmp("mean", token)) return_val = (elements_len > 0) ? return_val / elements_len : NAN;
+        } else if (tokencmp("min", token) || tokencmp("max", token)) {
+          bool is_min = tokencmp("min", token);
+          return_val = NAN;
+          for (int a = 0; a < arity; a++) {
+            int len = 0;
+            double* elements = value_elements(&args[a], &len);
+            for (int e = 0; e < len; e++) {
+              if (isnan(return_val) || (is_min ? elements[e] < return_val : elements[e] > return_val)) return_val = elements[e];
+            }
+          }
+        } else if (tokencmp("dot", token)) {
+          int b_len = 0;
+          double* b_elements = value_elements(&args[1], &b_len);
+          if (arity != 2 || arg_len != b_len) SYNTAX_ERROR("dot expects two arrays of the same length");
+          else return_val = array_dot(arg_elements, b_elements, arg_len);
+        } else if (tokencmp("sort", token)) {
+          if (arg.type != TOKEN_ARR) SYNTAX_ERROR("sort expects an array");
+          else {
+            qsort(arg.array, arg.array_len, sizeof(double), compare_doubles);
+            is_array_output = true;
+            array_output = arg;
+          }
         } else {
           SYNTAX_ERROR("Unknown function or command");
         }
+        if (trace_active) trace_span(TRACE_CALL, call_start, token_str(token), token_lens[token], token_offsets[token]);
 
-        if (is_string_output) {
+        if (is_array_output) {
+          evaluation_stack[evaluation_stack_len++] = array_output;
+        } else if (is_string_output) {
           if (return_val == 0) {
             int string_len = strlen(string_output);
             strcpy(&evaluation_string_storage[string_storage_len], string_output);
             string_storage_len += string_len; 
-            evaluation_stack[evaluation_stack_len++] = (Token_t){ .type = TOKEN_STR, .str = &evaluation_string_storage[string_storage_len-string_len], .str_len = string_len };
+            evaluation_stack[evaluation_stack_len++] = (Value_t){ .type = TOKEN_STR, .str = &evaluation_string_storage[string_storage_len-string_len], .str_len = string_len };
           } else {
             evaluation_string_storage[string_storage_len++] = (char)return_val;
-            evaluation_stack[evaluation_stack_len++] = (Token_t){ .type = TOKEN_STR, .str = &evaluation_string_storage[string_storage_len-1], .str_len = 1 };
+            evaluation_stack[evaluation_stack_len++] = (Value_t){ .type = TOKEN_STR, .str = &evaluation_string_storage[string_storage_len-1], .str_len = 1 };
           }
-        } else evaluation_stack[evaluation_stack_len++] = (Token_t){ .type = TOKEN_NUM, .value = return_val };
+        } else evaluation_stack[evaluation_stack_len++] = (Value_t){ .type = TOKEN_NUM, .value = return_val };
       } else {
-        if (token->type == TOKEN_NEG ||
-            token->type == TOKEN_NOT ||
-            token->type == TOKEN_BNOT) {
+        if (type == TOKEN_NEG ||
+            type == TOKEN_NOT ||
+            type == TOKEN_BNOT) {
           if (evaluation_stack_len < 1) SYNTAX_ERROR("Negative or inversed numbers expect a numeric literal");
           if (evaluation_stack_len >= 1) {
-            switch(token->type) {
-              case TOKEN_NEG: 
-                evaluation_stack[evaluation_stack_len-1].value = -evaluation_stack[evaluation_stack_len-1].value;
-                break;
-              case TOKEN_NOT:
-                evaluation_stack[evaluation_stack_len-1].value = !evaluation_stack[evaluation_stack_len-1].value;
-                break;
-              case TOKEN_BNOT:
-                evaluation_stack[evaluation_stack_len-1].value = ~((int)evaluation_stack[evaluation_stack_len-1].value);
-                break;
-              default: break;
+            Value_t* top = &evaluation_stack[evaluation_stack_len-1];
+            if (trace_active) {
+              TraceEvent_t* event = trace_record(TRACE_OPERATOR, type, token_offsets[token]);
+              event->duration = (top->type == TOKEN_ARR) ? top->array_len : 0;
+              event->a = top->value;
+              trace_commit();
             }
+            if (top->type == TOKEN_ARR) {
+              for (int e = 0; e < top->array_len; e++) top->array[e] = apply_unary_operator(type, top->array[e]);
+            } else top->value = apply_unary_operator(type, top->value);
             continue;
           }
         }
-        if (evaluation_stack_len < 2) SYNTAX_ERROR("Infix expression expected left and right number literal");
+        if (evaluation_stack_len < 2) {
+          SYNTAX_ERROR("Infix expression expected left and right number literal");
+          break;
+        }
 
-        Token_t b = evaluation_stack[--evaluation_stack_len];
-        Token_t a = evaluation_stack[--evaluation_stack_len];
+        Value_t b = evaluation_stack[--evaluation_stack_len];
+        Value_t a = evaluation_stack[--evaluation_stack_len];
+        if (trace_active) {
+          TraceEvent_t* event = trace_record(TRACE_OPERATOR, type, token_offsets[token]);
+          event->duration = (a.type == TOKEN_ARR) ? a.array_len : (b.type == TOKEN_ARR) ? b.array_len : 0;
+          event->a = a.value;
+          event->b = b.value;
+          trace_commit();
+        }
 
         if (a.type == TOKEN_NUM && b.type == TOKEN_NUM) {
-          double ans = 0.0;
-
-          if (debug) printf("%0.2f %0.2f\n", a.value, b.value);
-
-          switch (token->type) {
-            case TOKEN_MUL: ans = a.value * b.value; break;
-            case TOKEN_DIV: ans = a.value / b.value; break;
-            case TOKEN_ADD: ans = a.value + b.value; break;
-            case TOKEN_SUB: ans = a.value - b.value; break;
-            case TOKEN_POW: ans = pow(a.value, b.value); break;
-            case TOKEN_REM: ans = (int)a.value % (int)b.value; break;
-            case TOKEN_BSL: ans = (int)a.value << (int)b.value; break;
-            case TOKEN_BSR: ans = (int)a.value >> (int)b.value; break;
-            case TOKEN_EQU: ans = (a.value == b.value); break;
-            case TOKEN_BOR: ans = (int)a.value | (int)b.value; break;
-            case TOKEN_BAND: ans = (int)a.value & (int)b.value; break;
-            case TOKEN_BXOR: ans = (int)a.value ^ (int)b.value; break;
-            default: SYNTAX_ERROR("Operator not implemented");
+          double ans = apply_number_operator(type, a.value, b.value);
+          evaluation_stack[evaluation_stack_len++] = (Value_t){ .type = TOKEN_NUM, .value = ans };
+        } else if ((a.type == TOKEN_ARR || a.type == TOKEN_NUM) && (b.type == TOKEN_ARR || b.type == TOKEN_NUM)) {
+          if (a.type == TOKEN_ARR && b.type == TOKEN_ARR && a.array_len != b.array_len) {
+            SYNTAX_ERROR("Array length mismatch");
+            break;
           }
-          evaluation_stack[evaluation_stack_len++] = (Token_t){ .type = TOKEN_NUM, .value = ans };
+          // Both operands are consumed, so the result can be written over one of them
+          Value_t result = (a.type == TOKEN_ARR) ? a : b;
+          int a_len = 0, b_len = 0;
+          double* a_elements = value_elements(&a, &a_len);
+          double* b_elements = value_elements(&b, &b_len);
+          array_operator(type, result.array, a_elements, a.type == TOKEN_NUM, b_elements, b.type == TOKEN_NUM, result.array_len);
+          evaluation_stack[evaluation_stack_len++] = result;
         } else if (a.type == TOKEN_STR && b.type == TOKEN_STR) {
-          switch (token->type) {
+          switch (type) {
             case TOKEN_ADD:
               int str_begin = string_storage_len;
               memcpy(&evaluation_string_storage[string_storage_len], a.str, a.str_len);
               string_storage_len += a.str_len;
               memcpy(&evaluation_string_storage[string_storage_len], b.str, b.str_len);
               string_storage_len += b.str_len;
-              evaluation_stack[evaluation_stack_len++] = (Token_t){ .type = TOKEN_STR, .str = &evaluation_string_storage[str_begin], .str_len = a.str_len + b.str_len };
+              evaluation_stack[evaluation_stack_len++] = (Value_t){ .type = TOKEN_STR, .str = &evaluation_string_storage[str_begin], .str_len = a.str_len + b.str_len };
               break;
             default: SYNTAX_ERROR("Operator not permitted on string");
           }
@@ -686,35 +2383,25 @@ void evaluate_tokens(char* output) { // Shunting Yard Algorithm
         }
 
       }
-    } else {
+    } else if (type != TOKEN_COMMA) {
       SYNTAX_ERROR("Unhandled token. How did this happen?");
     }
   }
 
   if (evaluation_stack_len != 1) SYNTAX_ERROR("Unfinished expression");
 
-  if (debug) {
-    printf("\nEVALUATION STACK %d\n", evaluation_stack_len);
-    for (int i = 0; i < evaluation_stack_len; i++) {
-      printf("%0.3f\n", evaluation_stack[i].value);
-    }
-    printf("\n");
-  }
-
   if (evaluation_stack[0].type == TOKEN_STR) {
     for (int i = 0; i < evaluation_stack[0].str_len; i++) {
       if (i > OUTPUT_SIZE) break;
       output[i] = evaluation_stack[0].str[i];
     }
+  } else if (evaluation_stack[0].type == TOKEN_ARR) {
+    format_array(output, OUTPUT_SIZE, output_type, evaluation_stack[0].array, evaluation_stack[0].array_len);
   } else {
-    switch (output_type) {
-      case OUTPUT_DEC: snprintf(output, OUTPUT_SIZE, "%0.3f", evaluation_stack[0].value); break;
-      case OUTPUT_HEX: snprintf(output, OUTPUT_SIZE, "0x%X", (int)evaluation_stack[0].value); break;
-      case OUTPUT_BIN: snprintf(output, OUTPUT_SIZE, "0b%b", (int)evaluation_stack[0].value); break;
-      default: SYNTAX_ERROR("Unknown output type");
-    }
+    format_number(output, OUTPUT_SIZE, output_type, evaluation_stack[0].value);
   }
 
+  return true;
 }
 
 struct termios original_spec = {0};
@@ -734,6 +2421,35 @@ void setup_terminal() {
 }
 
 
+// Evaluates the line being typed, only re-lexing and re-parsing from the edit onwards
+bool preview_line(char* prompt, int edit_offset, char* output) {
+  bool was_tracing = trace_active;
+  trace_active = false;
+  previewing = true;
+  syntax_error_raised = false;
+
+  tokenise_edit(prompt, edit_offset);
+  bool finished = evaluate_tokens(output);
+
+  previewing = false;
+  trace_active = was_tracing;
+  return finished && !syntax_error_raised;
+}
+
+// Shows the result of the line after its end, leaving the cursor where it was
+void render_preview(char* prompt, int edit_offset, int cursor) {
+  char output[OUTPUT_SIZE] = {0};
+  // A newer key is already waiting, it will trigger its own preview
+  bool show = !input_pending() && prompt[0] != 0 && preview_line(prompt, edit_offset, output);
+
+  int prompt_len = strlen(prompt);
+  printf("\0337");
+  if (prompt_len > cursor) printf("\033[%dC", prompt_len - cursor);
+  if (show) printf("  \033[2m= %s\033[0m", output);
+  printf("\033[K\0338");
+  fflush(stdout);
+}
+
 void handle_keyboard(char* prompt, char* prompt_history, int current_history_index) {
   int initial_history_ind = current_history_index;
   char c;
@@ -741,6 +2457,10 @@ void handle_keyboard(char* prompt, char* prompt_history, int current_history_ind
   bool editing_middle = false;
   while (read(STDIN_FILENO, &c, 1) == 1) {
     if (c == '\n' || c == '\b') {
+      int prompt_len = strlen(prompt);
+      if (prompt_len > i) printf("\033[%dC", prompt_len - i);
+      printf("\033[K");
+      fflush(stdout);
       write(STDOUT_FILENO, "\n", 1);
       break;
     }
@@ -748,7 +2468,7 @@ void handle_keyboard(char* prompt, char* prompt_history, int current_history_ind
       // printf("\r\033[%dC", i + 2);
       prompt[--i] = 0;
       printf("\033[1D \033[1D");
-      fflush(stdout);
+      render_preview(prompt, i, i);
     } else if (c == '\033') {
       char nc[2];
       read(STDIN_FILENO, nc, 2);
@@ -777,6 +2497,7 @@ void handle_keyboard(char* prompt, char* prompt_history, int current_history_ind
             memcpy(prompt, &prompt_history[current_history_index * PROMPT_SIZE], PROMPT_SIZE);
             i = strlen(prompt);
             printf("\033[2K\r%s%s", PROMPT_STRING, prompt);
+            render_preview(prompt, 0, i);
             break; //up
           case 'B':
             if (current_history_index < initial_history_ind-1) {
@@ -787,6 +2508,7 @@ void handle_keyboard(char* prompt, char* prompt_history, int current_history_ind
               memset(prompt, 0, PROMPT_SIZE);
             }
             printf("\033[2K\r%s%s", PROMPT_STRING, prompt);
+            render_preview(prompt, 0, i);
             break; //down
         }
         fflush(stdout);
@@ -794,21 +2516,30 @@ void handle_keyboard(char* prompt, char* prompt_history, int current_history_ind
     } else if (!iscntrl(c)) {
       prompt[i++] = c;
       putchar(c);
-      fflush(stdout);
+      render_preview(prompt, i-1, i);
     } 
 
   }
 }
 
-int main() {
+int main(int argc, char** argv) {
   base64_init();
-  char* prompt_storage = (char*)malloc(sizeof(char) * PROMPT_SIZE * PROMPT_HISTORY_SIZE);
-  int prompt_storage_index = 0;
+  rng_seed(&rng, (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32));
+  prompt_storage = (char*)calloc(PROMPT_SIZE * PROMPT_HISTORY_SIZE, sizeof(char));
 
   if (prompt_storage == NULL) {
     printf("Error allocating memory for prompt history, it will be disabled\n");
   }
 
+  for (int a = 1; a < argc; a++) {
+    if (strcmp(argv[a], "--load") == 0 && a+1 < argc) {
+      if (session_load(argv[++a]) < 0) printf("Could not load session %s\n", argv[a]);
+    } else {
+      printf("Usage: %s [--load session.ifx]\n", argv[0]);
+      return 1;
+    }
+  }
+
 
   evaluation_string_storage = (char*)malloc(sizeof(char) * STRING_STORAGE_SIZE);
   if (evaluation_string_storage == NULL) {
@@ -838,8 +2569,11 @@ int main() {
     prompt[strlen(prompt)-1] = 0;
 #endif
 
+    trace_active = trace_every > 0 && trace_expressions++ % trace_every == 0;
+    uint64_t expression_start = trace_active ? trace_now() : 0;
     tokenise(prompt);
     evaluate_tokens(output);
+    if (trace_active) trace_span(TRACE_EXPRESSION, expression_start, prompt, strlen(prompt), 0);
 
     printf("%s\n", output);
     fflush(stdout);
@@ -847,4 +2581,5 @@ int main() {
 
   free(prompt_storage);
   free(evaluation_string_storage);
+  array_pool_free();
 }
@@ -1,5 +1,5 @@
 #!/bin/sh
-gcc main.c -o main -g -lm 
+gcc main.c -o main -g -lm -pthread 
 if [ $? == "0" ]; then
   ./main
 fi